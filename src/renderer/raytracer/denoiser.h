@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <linalg.h>
+#include <omp.h>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Every
+	// iteration applies a 5x5 B3-spline kernel whose taps are 2^i pixels
+	// apart, weighted down across color, normal, albedo and depth edges.
+	class atrous_denoiser
+	{
+	public:
+		void set_iterations(unsigned in_iterations);
+		unsigned get_iterations() const;
+
+		// Filters a width x height color image guided by the first-hit
+		// buffers. Pixels without a hit carry a zero normal.
+		void denoise(const float3* color, const float3* normals, const float3* albedo,
+					 const float* depth, size_t width, size_t height,
+					 std::vector<float3>& result);
+
+	protected:
+		// One array per channel, so the filter runs across pixels in SIMD lanes
+		struct planes
+		{
+			void resize(size_t size);
+
+			std::vector<float> r;
+			std::vector<float> g;
+			std::vector<float> b;
+		};
+
+		void filter_pass(const planes& input, planes& output, int step, float color_phi) const;
+		// exp() for the non-positive exponents of the edge weights, without
+		// a library call, so the tap loops vectorize
+		static float exp_negative(float x);
+
+		// Zero passes the image through, five reach 31 pixels out
+		unsigned iterations = 0;
+		// Color differences are tolerated less every iteration, as the
+		// image gets smoother
+		float color_phi = 0.5f;
+		float albedo_phi = 0.1f;
+		// Depth differences relative to the pixel's depth, per pixel of step
+		float depth_phi = 0.02f;
+		// Each pass filters square tiles of this many pixels, one row of a
+		// tile per vector loop
+		static constexpr int tile_size = 32;
+		static constexpr float kernel[5] = {1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+
+		int width = 0;
+		int height = 0;
+		planes normal_planes;
+		planes albedo_planes;
+		std::vector<float> depth_plane;
+		std::vector<float> inverse_depth_plane;
+		// One for hits, zero for misses
+		std::vector<float> hit_plane;
+		planes ping;
+		planes pong;
+	};
+
+	inline void atrous_denoiser::planes::resize(size_t size)
+	{
+		r.resize(size);
+		g.resize(size);
+		b.resize(size);
+	}
+
+	inline void atrous_denoiser::set_iterations(unsigned in_iterations)
+	{
+		iterations = in_iterations;
+	}
+
+	inline unsigned atrous_denoiser::get_iterations() const
+	{
+		return iterations;
+	}
+
+	inline void atrous_denoiser::denoise(const float3* color, const float3* normals,
+										 const float3* albedo, const float* depth,
+										 size_t in_width, size_t in_height,
+										 std::vector<float3>& result)
+	{
+		width = static_cast<int>(in_width);
+		height = static_cast<int>(in_height);
+		const int pixel_count = width * height;
+
+		ping.resize(pixel_count);
+		pong.resize(pixel_count);
+		normal_planes.resize(pixel_count);
+		albedo_planes.resize(pixel_count);
+		depth_plane.resize(pixel_count);
+		inverse_depth_plane.resize(pixel_count);
+		hit_plane.resize(pixel_count);
+#pragma omp parallel for
+		for (int pixel_id = 0; pixel_id < pixel_count; pixel_id++) {
+			ping.r[pixel_id] = color[pixel_id].x;
+			ping.g[pixel_id] = color[pixel_id].y;
+			ping.b[pixel_id] = color[pixel_id].z;
+			normal_planes.r[pixel_id] = normals[pixel_id].x;
+			normal_planes.g[pixel_id] = normals[pixel_id].y;
+			normal_planes.b[pixel_id] = normals[pixel_id].z;
+			albedo_planes.r[pixel_id] = albedo[pixel_id].x;
+			albedo_planes.g[pixel_id] = albedo[pixel_id].y;
+			albedo_planes.b[pixel_id] = albedo[pixel_id].z;
+			depth_plane[pixel_id] = depth[pixel_id];
+			inverse_depth_plane[pixel_id] = 1.f / std::max(depth[pixel_id], 1e-3f);
+			hit_plane[pixel_id] = dot(normals[pixel_id], normals[pixel_id]) > 0.f ? 1.f : 0.f;
+		}
+
+		for (unsigned i = 0; i < iterations; i++) {
+			filter_pass(ping, pong, 1 << i, color_phi / static_cast<float>(1 << i));
+			std::swap(ping, pong);
+		}
+
+		result.resize(pixel_count);
+#pragma omp parallel for
+		for (int pixel_id = 0; pixel_id < pixel_count; pixel_id++)
+			result[pixel_id] = float3{ping.r[pixel_id], ping.g[pixel_id], ping.b[pixel_id]};
+	}
+
+	// Tiles spread over the threads. Within a tile row every tap is applied
+	// to all pixels of the row before the next one, across SIMD lanes
+	inline void atrous_denoiser::filter_pass(const planes& input, planes& output, int step,
+											 float color_phi) const
+	{
+		const int tiles_x = (width + tile_size - 1) / tile_size;
+		const int tiles_y = (height + tile_size - 1) / tile_size;
+		const float inv_color_phi2 = 1.f / (color_phi * color_phi);
+		const float inv_albedo_phi2 = 1.f / (albedo_phi * albedo_phi);
+		const float inv_depth_phi = 1.f / (depth_phi * static_cast<float>(step));
+
+		const float* color_r = input.r.data();
+		const float* color_g = input.g.data();
+		const float* color_b = input.b.data();
+		const float* normal_x = normal_planes.r.data();
+		const float* normal_y = normal_planes.g.data();
+		const float* normal_z = normal_planes.b.data();
+		const float* albedo_r = albedo_planes.r.data();
+		const float* albedo_g = albedo_planes.g.data();
+		const float* albedo_b = albedo_planes.b.data();
+		const float* depths = depth_plane.data();
+		const float* inverse_depths = inverse_depth_plane.data();
+		const float* hits = hit_plane.data();
+
+#pragma omp parallel for schedule(dynamic)
+		for (int tile_id = 0; tile_id < tiles_x * tiles_y; tile_id++) {
+			const int x_begin = (tile_id % tiles_x) * tile_size;
+			const int y_begin = (tile_id / tiles_x) * tile_size;
+			const int x_count = std::min(tile_size, width - x_begin);
+			const int y_end = std::min(y_begin + tile_size, height);
+
+			for (int y = y_begin; y < y_end; y++) {
+				const int row = y * width + x_begin;
+				float sum_r[tile_size];
+				float sum_g[tile_size];
+				float sum_b[tile_size];
+				float weight_sum[tile_size];
+				const float center_weight = kernel[2] * kernel[2];
+#pragma omp simd
+				for (int i = 0; i < x_count; i++) {
+					sum_r[i] = color_r[row + i] * center_weight;
+					sum_g[i] = color_g[row + i] * center_weight;
+					sum_b[i] = color_b[row + i] * center_weight;
+					weight_sum[i] = center_weight;
+				}
+
+				for (int dy = -2; dy <= 2; dy++) {
+					const int tap_y = y + dy * step;
+					if (tap_y < 0 || tap_y >= height)
+						continue;
+					const int tap_row = tap_y * width;
+					for (int dx = -2; dx <= 2; dx++) {
+						if (dx == 0 && dy == 0)
+							continue;
+						const float tap_kernel = kernel[dy + 2] * kernel[dx + 2];
+
+						// Taps past the image border are left out, the weights get
+						// normalized anyway. The rest read at a fixed offset, which
+						// keeps the loads contiguous
+						const int tap_x = x_begin + dx * step;
+						const int inside_begin = std::min(std::max(-tap_x, 0), x_count);
+						const int inside_end = std::max(std::min(width - tap_x, x_count), inside_begin);
+#pragma omp simd
+						for (int i = inside_begin; i < inside_end; i++) {
+							const int center = row + i;
+							const int tap = tap_row + tap_x + i;
+							const float cosine = normal_x[center] * normal_x[tap] +
+												 normal_y[center] * normal_y[tap] +
+												 normal_z[center] * normal_z[tap];
+							// max(cosine, 0) without a float compare, which would keep
+							// the loop from vectorizing under trapping math
+							float normal_weight = 0.5f * (cosine + std::abs(cosine));
+							// Raised to the 64th power, as six squarings
+							normal_weight *= normal_weight;
+							normal_weight *= normal_weight;
+							normal_weight *= normal_weight;
+							normal_weight *= normal_weight;
+							normal_weight *= normal_weight;
+							normal_weight *= normal_weight;
+							// Hits and misses never mix, misses mix freely
+							normal_weight = hits[center] * normal_weight +
+											(1.f - hits[center]) * (1.f - hits[tap]);
+
+							const float delta_r = color_r[tap] - color_r[center];
+							const float delta_g = color_g[tap] - color_g[center];
+							const float delta_b = color_b[tap] - color_b[center];
+							const float albedo_delta_r = albedo_r[tap] - albedo_r[center];
+							const float albedo_delta_g = albedo_g[tap] - albedo_g[center];
+							const float albedo_delta_b = albedo_b[tap] - albedo_b[center];
+							const float depth_delta = std::abs(depths[tap] - depths[center]) *
+													  inverse_depths[center];
+
+							const float weight = tap_kernel * normal_weight * exp_negative(
+									-(delta_r * delta_r + delta_g * delta_g + delta_b * delta_b) * inv_color_phi2 -
+									(albedo_delta_r * albedo_delta_r + albedo_delta_g * albedo_delta_g +
+									 albedo_delta_b * albedo_delta_b) * inv_albedo_phi2 -
+									depth_delta * inv_depth_phi);
+							sum_r[i] += color_r[tap] * weight;
+							sum_g[i] += color_g[tap] * weight;
+							sum_b[i] += color_b[tap] * weight;
+							weight_sum[i] += weight;
+						}
+					}
+				}
+
+#pragma omp simd
+				for (int i = 0; i < x_count; i++) {
+					output.r[row + i] = sum_r[i] / weight_sum[i];
+					output.g[row + i] = sum_g[i] / weight_sum[i];
+					output.b[row + i] = sum_b[i] / weight_sum[i];
+				}
+			}
+		}
+	}
+
+	// 2^(x log2 e) split into an exponent written to the float's bits and a
+	// fraction from a degree 5 polynomial, within 1e-4 relative error
+	inline float atrous_denoiser::exp_negative(float x)
+	{
+		// max(x, -87) without a float compare
+		const float clamped = 0.5f * (x - 87.f + std::abs(x + 87.f));
+		const float scaled = clamped * 1.44269504f;
+		// Truncation is floor() once shifted positive, and unlike floor() it
+		// needs no library call
+		const int32_t whole = static_cast<int32_t>(scaled + 128.f) - 128;
+		const float fraction = scaled - static_cast<float>(whole);
+		const float power = 1.f + fraction * (0.693147182f + fraction * (0.240226507f +
+										   fraction * (0.0555041087f + fraction * (0.00961812911f +
+										   fraction * 0.00133335581f))));
+		const int32_t bits = (whole + 127) << 23;
+		float scale;
+		std::memcpy(&scale, &bits, sizeof(scale));
+		return power * scale;
+	}
+}// namespace cg::renderer
@@ -1,12 +1,41 @@
 #pragma once
 
+#include "renderer/raytracer/denoiser.h"
+#include "renderer/raytracer/sampler.h"
+#include "renderer/raytracer/sampling.h"
 #include "resource.h"
+#include "utils/error_handler.h"
+#include "utils/file_utils.h"
+#include "utils/tile_scheduler.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <linalg.h>
 #include <memory>
+#include <numeric>
 #include <omp.h>
 #include <random>
+#include <string>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CG_SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CG_SIMD_SSE
+#endif
 
 using namespace linalg::aliases;
 
@@ -14,12 +43,15 @@ namespace cg::renderer
 {
 	struct ray
 	{
+		ray() = default;
 		ray(float3 position, float3 direction) : position(position)
 		{
 			this->direction = normalize(direction);
+			inv_direction = 1.f / this->direction;
 		}
 		float3 position;
 		float3 direction;
+		float3 inv_direction;
 	};
 
 	struct payload
@@ -27,19 +59,40 @@ namespace cg::renderer
 		float t;
 		float3 bary;
 		cg::color color;
+		// Random numbers of the path at this bounce
+		sampler random;
+		// Product of the path's attenuations up to this hit, divided by its
+		// Russian roulette survival probabilities
+		float3 throughput{1.f, 1.f, 1.f};
 	};
 
-	template<typename VB>
-	struct triangle
+	// Positions and edges, the only data the intersection test reads
+	struct triangle_geometry
 	{
-		triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c);
+		triangle_geometry() = default;
+		template<typename VB>
+		triangle_geometry(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c);
 
 		float3 a;
-		float3 b;
-		float3 c;
-
 		float3 ba;
 		float3 ca;
+	};
+
+	template<typename VB>
+	inline triangle_geometry::triangle_geometry(const VB& vertex_a, const VB& vertex_b,
+												const VB& vertex_c)
+	{
+		a = float3{vertex_a.x, vertex_a.y, vertex_a.z};
+		ba = float3{vertex_b.x, vertex_b.y, vertex_b.z} - a;
+		ca = float3{vertex_c.x, vertex_c.y, vertex_c.z} - a;
+	}
+
+	// Shading attributes, only read for the closest hit
+	template<typename VB>
+	struct triangle
+	{
+		triangle() = default;
+		triangle(const VB& vertex_a, const VB& vertex_b, const VB& vertex_c);
 
 		float3 na;
 		float3 nb;
@@ -48,19 +101,16 @@ namespace cg::renderer
 		float3 ambient;
 		float3 diffuse;
 		float3 emissive;
+
+		unsigned material_id;
+		// Vertex buffer the triangle came from
+		unsigned shape_id = 0;
 	};
 
 	template<typename VB>
 	inline triangle<VB>::triangle(const VB& vertex_a, const VB& vertex_b,
 								  const VB& vertex_c)
 	{
-		a = float3{vertex_a.x, vertex_a.y, vertex_a.z};
-		b = float3{vertex_b.x, vertex_b.y, vertex_b.z};
-		c = float3{vertex_c.x, vertex_c.y, vertex_c.z};
-
-		ba = b - a;
-		ca = c - a;
-
 		na = float3{vertex_a.nx, vertex_a.ny, vertex_a.nz};
 		nb = float3{vertex_b.nx, vertex_b.ny, vertex_b.nz};
 		nc = float3{vertex_c.nx, vertex_c.ny, vertex_c.nz};
@@ -69,21 +119,445 @@ namespace cg::renderer
 		diffuse = float3{vertex_a.diffuse_r, vertex_a.diffuse_g, vertex_a.diffuse_b};
 		emissive =
 				float3{vertex_a.emissive_r, vertex_a.emissive_g, vertex_a.emissive_b};
+
+		material_id = static_cast<unsigned>(vertex_a.material_id);
 	}
 
+	struct aabb
+	{
+		void add_point(const float3& point);
+		void add_aabb(const aabb& other);
+		// Shrinks the box to its overlap with the other one
+		void clip(const aabb& other);
+		float surface_area() const;
+		bool is_empty() const;
+		float aabb_test(const ray& ray, float min_t, float max_t) const;
+
+		float3 aabb_min{std::numeric_limits<float>::max()};
+		float3 aabb_max{std::numeric_limits<float>::lowest()};
+	};
+
+	struct bvh_node
+	{
+		bool is_leaf() const { return triangle_count > 0; }
+
+		aabb bounds;
+		// Index of the left child for inner nodes (the right one follows it),
+		// index of the first triangle for leaves
+		unsigned left_first;
+		unsigned triangle_count;
+	};
+
+	// Width of the collapsed BVH nodes and triangle blocks follows the widest
+	// available vector unit
+#if defined(CG_SIMD_AVX)
+	constexpr unsigned wide_bvh_width = 8;
+
+	using simd_float = __m256;
+	inline simd_float simd_set(float value) { return _mm256_set1_ps(value); }
+	inline simd_float simd_load(const float* data) { return _mm256_load_ps(data); }
+	inline void simd_store(float* data, simd_float value) { _mm256_store_ps(data, value); }
+	inline simd_float simd_add(simd_float a, simd_float b) { return _mm256_add_ps(a, b); }
+	inline simd_float simd_sub(simd_float a, simd_float b) { return _mm256_sub_ps(a, b); }
+	inline simd_float simd_mul(simd_float a, simd_float b) { return _mm256_mul_ps(a, b); }
+	inline simd_float simd_div(simd_float a, simd_float b) { return _mm256_div_ps(a, b); }
+	inline simd_float simd_min(simd_float a, simd_float b) { return _mm256_min_ps(a, b); }
+	inline simd_float simd_max(simd_float a, simd_float b) { return _mm256_max_ps(a, b); }
+	inline simd_float simd_and(simd_float a, simd_float b) { return _mm256_and_ps(a, b); }
+	inline simd_float simd_less(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	inline simd_float simd_less_equal(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	inline unsigned simd_mask(simd_float value) { return static_cast<unsigned>(_mm256_movemask_ps(value)); }
+#elif defined(CG_SIMD_SSE)
+	constexpr unsigned wide_bvh_width = 4;
+
+	using simd_float = __m128;
+	inline simd_float simd_set(float value) { return _mm_set1_ps(value); }
+	inline simd_float simd_load(const float* data) { return _mm_load_ps(data); }
+	inline void simd_store(float* data, simd_float value) { _mm_store_ps(data, value); }
+	inline simd_float simd_add(simd_float a, simd_float b) { return _mm_add_ps(a, b); }
+	inline simd_float simd_sub(simd_float a, simd_float b) { return _mm_sub_ps(a, b); }
+	inline simd_float simd_mul(simd_float a, simd_float b) { return _mm_mul_ps(a, b); }
+	inline simd_float simd_div(simd_float a, simd_float b) { return _mm_div_ps(a, b); }
+	inline simd_float simd_min(simd_float a, simd_float b) { return _mm_min_ps(a, b); }
+	inline simd_float simd_max(simd_float a, simd_float b) { return _mm_max_ps(a, b); }
+	inline simd_float simd_and(simd_float a, simd_float b) { return _mm_and_ps(a, b); }
+	inline simd_float simd_less(simd_float a, simd_float b) { return _mm_cmplt_ps(a, b); }
+	inline simd_float simd_less_equal(simd_float a, simd_float b) { return _mm_cmple_ps(a, b); }
+	inline unsigned simd_mask(simd_float value) { return static_cast<unsigned>(_mm_movemask_ps(value)); }
+#else
+	constexpr unsigned wide_bvh_width = 4;
+#endif
+	constexpr unsigned triangle_block_width = wide_bvh_width;
+
+	// Collapsed BVH node with child boxes stored as SoA, so all of them are
+	// tested against a ray in one vector pass
+	struct alignas(32) wide_bvh_node
+	{
+		unsigned intersect(const ray& ray, float min_t, float max_t,
+						   float* t_near) const;
+
+		float min_x[wide_bvh_width];
+		float min_y[wide_bvh_width];
+		float min_z[wide_bvh_width];
+		float max_x[wide_bvh_width];
+		float max_y[wide_bvh_width];
+		float max_z[wide_bvh_width];
+		// Index of a child node for inner children, of the first triangle block for leaves
+		unsigned children[wide_bvh_width];
+		// Zero for inner children
+		unsigned triangle_counts[wide_bvh_width];
+		unsigned child_count;
+	};
+
+	// Leaf triangles packed as SoA, holding only what the intersection test reads
+	struct alignas(32) triangle_block
+	{
+		int intersect(const ray& ray, float min_t, float max_t,
+					  float& t, float& u, float& v) const;
+		bool occluded(const ray& ray, float min_t, float max_t) const;
+		unsigned intersect_lanes(const ray& ray, float min_t, float max_t,
+								 float* lane_t, float* lane_u, float* lane_v) const;
+		void set_triangle(unsigned lane, const triangle_geometry& source, unsigned triangle_id);
+		triangle_geometry get_triangle(unsigned lane) const;
+
+		float a_x[triangle_block_width];
+		float a_y[triangle_block_width];
+		float a_z[triangle_block_width];
+		float ba_x[triangle_block_width];
+		float ba_y[triangle_block_width];
+		float ba_z[triangle_block_width];
+		float ca_x[triangle_block_width];
+		float ca_y[triangle_block_width];
+		float ca_z[triangle_block_width];
+		unsigned triangle_ids[triangle_block_width];
+	};
+
+	// Read-only view of a contiguous array stored elsewhere
+	template<typename T>
+	class array_view
+	{
+	public:
+		using value_type = T;
+
+		array_view() = default;
+		array_view(const T* in_data, size_t in_size) : items(in_data), count(in_size) {}
+		array_view(const std::vector<T>& source) : items(source.data()), count(source.size()) {}
+
+		const T* data() const { return items; }
+		size_t size() const { return count; }
+		bool empty() const { return count == 0; }
+		const T& operator[](size_t index) const { return items[index]; }
+		const T* begin() const { return items; }
+		const T* end() const { return items + count; }
+
+	private:
+		const T* items = nullptr;
+		size_t count = 0;
+	};
+
+	// Subtree pending in a traversal stack: a wide node, or a leaf given by its
+	// first triangle block and triangle count
+	struct traversal_entry
+	{
+		unsigned index;
+		unsigned triangle_count;
+		float t;
+	};
+
+	enum class bvh_build_mode
+	{
+		// Binned surface area heuristic, slower to build but faster to trace
+		sah,
+		// Morton-code ordered linear BVH for per-frame rebuilds
+		lbvh,
+		// Surface area heuristic with spatial splits, which clip triangles
+		// into both children. Slowest to build, fewest node visits for long
+		// thin triangles
+		sbvh
+	};
+
 	template<typename VB>
-	class aabb
+	class bvh
 	{
 	public:
-		void add_triangle(const triangle<VB> triangle);
-		const std::vector<triangle<VB>>& get_triangles() const;
-		bool aabb_test(const ray& ray) const;
+		void build(std::vector<triangle_geometry> in_geometry,
+				   std::vector<triangle<VB>> in_triangles,
+				   bvh_build_mode mode = bvh_build_mode::sah);
+		// Tree over arbitrary boxes without any triangles, such as the top
+		// level over instances. Leaf ranges index get_primitive_indices()
+		void build(const std::vector<aabb>& in_bounds);
+
+		array_view<bvh_node> get_nodes() const;
+		array_view<wide_bvh_node> get_wide_nodes() const;
+		array_view<triangle_block> get_triangle_blocks() const;
+		array_view<triangle<VB>> get_triangles() const;
+		// Geometry of each stored triangle, read back from the leaf blocks
+		// since the build geometry is freed after collapsing
+		std::vector<triangle_geometry> get_triangle_geometry() const;
+		array_view<unsigned> get_primitive_indices() const;
+
+		// Moves the boxes and triangle blocks to new positions of the same
+		// triangles, given in build order. The tree topology stays as it is.
+		void refit(const std::vector<triangle_geometry>& in_geometry,
+				   const std::vector<triangle<VB>>& in_triangles);
+		// Surface area heuristic cost of the binary tree relative to the root area
+		float get_sah_cost() const;
+		float get_build_sah_cost() const;
+
+		void save(const std::filesystem::path& cache_path, uint64_t key) const;
+		// Maps the cache file and traverses its arrays in place, keeping the
+		// mapping open until the next build
+		bool load(const std::filesystem::path& cache_path, uint64_t key);
+
+		static constexpr size_t max_depth = 64;
+		static constexpr uint32_t cache_version = 3;
 
 	protected:
+		static constexpr float traversal_cost = 1.f;
+		static constexpr float intersection_cost = 1.f;
+		static constexpr unsigned max_leaf_size = 16;
+		static constexpr int bin_count = 32;
+		// Nodes with more triangles are binned and subdivided as separate tasks
+		static constexpr unsigned task_threshold = 4096;
+		static constexpr unsigned binning_chunk_size = 16384;
+
+		struct bin
+		{
+			aabb bounds;
+			aabb centroid_bounds;
+			unsigned triangle_count = 0;
+		};
+		using bin_set = std::array<std::array<bin, bin_count>, 3>;
+
+		void build_tree(size_t primitive_count, bvh_build_mode mode);
+		void subdivide(unsigned node_id, const aabb& centroid_bounds, size_t depth);
+		void fill_bins(const bvh_node& node, const aabb& centroid_bounds,
+					   bin_set& bins) const;
+		float find_best_split(const bin_set& bins, int& best_axis, int& best_bin) const;
+
+		static constexpr unsigned lbvh_leaf_size = 4;
+
+		// Spatial splits may add this fraction of the triangle count as extra references
+		static constexpr float spatial_split_budget = 0.3f;
+		// and are only tried where the object split children overlap by more
+		// than this fraction of the root surface area
+		static constexpr float spatial_split_overlap = 1e-5f;
+
+		// Part of a triangle in a spatial split build, bounded by its clipped box
+		struct reference
+		{
+			aabb bounds;
+			unsigned triangle;
+		};
+
+		void subdivide_spatial(unsigned node_id, std::vector<reference> references, size_t depth);
+		float find_object_split(const std::vector<reference>& references, int& best_axis,
+								float& best_position, aabb& left_bounds, aabb& right_bounds) const;
+		float find_spatial_split(const std::vector<reference>& references, const aabb& node_bounds,
+								 int& best_axis, float& best_position) const;
+		void split_reference(const reference& source, int axis, float position,
+							 reference& left, reference& right) const;
+
+		size_t reference_count = 0;
+		size_t reference_limit = 0;
+		float root_area = 0.f;
+
+		struct morton_key
+		{
+			uint64_t code;
+			unsigned index;
+		};
+
+		void sort_by_morton_codes(const aabb& centroid_bounds);
+		void emit_lbvh(unsigned node_id, size_t depth);
+		static uint64_t expand_bits(uint64_t value);
+		static uint64_t morton_code(const float3& normalized_position);
+
+		void collapse();
+		unsigned collapse_node(unsigned node_id);
+
+		// Subtrees above this depth are refitted as separate tasks
+		static constexpr size_t refit_task_depth = 6;
+
+		static aabb get_bounds(const triangle_geometry& triangle);
+		aabb refit_node(unsigned node_id, const std::vector<triangle_geometry>& in_geometry,
+						size_t depth);
+		aabb refit_wide_node(unsigned wide_id, const std::vector<triangle_geometry>& in_geometry,
+							 size_t depth);
+
+		// Cache files hold this header followed by the node, wide node, block
+		// and triangle arrays, each starting at a multiple of cache_alignment
+		struct cache_header
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t wide_width;
+			uint32_t block_width;
+			uint32_t triangle_size;
+			uint64_t key;
+			uint64_t node_count;
+			uint64_t wide_node_count;
+			uint64_t block_count;
+			uint64_t triangle_count;
+			uint64_t reference_count;
+		};
+		static constexpr size_t cache_alignment = 64;
+		static constexpr char cache_magic[8] = "CGBVH";
+		static_assert(alignof(wide_bvh_node) <= cache_alignment &&
+							  alignof(triangle_block) <= cache_alignment,
+					  "Mapped cache sections must be aligned for their elements");
+
+		// Points the views at the vectors below and closes any cache mapping
+		void update_views();
+		// Copies mapped arrays into the vectors before they are modified
+		void detach_cache();
+
+		std::vector<bvh_node> nodes;
+		std::vector<wide_bvh_node> wide_nodes;
+		std::vector<triangle_block> triangle_blocks;
+		std::atomic<unsigned> node_count{0};
 		std::vector<triangle<VB>> triangles;
+		std::vector<triangle_geometry> geometry;
+		// Leaf ranges of stored triangle ids, and the build input position of
+		// every stored triangle, both kept for refits
+		std::vector<unsigned> triangle_indices;
+		std::vector<unsigned> source_triangles;
+		float build_sah_cost = 0.f;
+		std::vector<aabb> triangle_bounds;
+		std::vector<float3> centroids;
+		std::vector<uint64_t> morton_codes;
+
+		// What the tree is read through: the vectors above after a build, or
+		// the sections of cache_file after a load
+		std::unique_ptr<cg::utils::mapped_file> cache_file;
+		array_view<bvh_node> node_view;
+		array_view<wide_bvh_node> wide_node_view;
+		array_view<triangle_block> block_view;
+		array_view<triangle<VB>> triangle_view;
+		array_view<unsigned> index_view;
+		array_view<unsigned> source_view;
+	};
+
+	inline float4x4 identity_transform()
+	{
+		return float4x4{
+				{1.f, 0.f, 0.f, 0.f},
+				{0.f, 1.f, 0.f, 0.f},
+				{0.f, 0.f, 1.f, 0.f},
+				{0.f, 0.f, 0.f, 1.f}};
+	}
+
+	// Placement of a bottom-level BVH in the world. Rays are moved into object
+	// space without renormalizing, so hit distances stay in world units
+	struct instance
+	{
+		ray to_object_space(const ray& world_ray) const;
+
+		float4x4 object_to_world;
+		float4x4 world_to_object;
+		unsigned bottom_level;
+		// Baked geometry is already in world space and skips the transform
+		bool identity;
+		aabb bounds;
+	};
+
+	// Bottom-level BVHs built once in object space, placed by instances and
+	// found through a top-level tree over the instance bounds
+	template<typename VB>
+	class top_level_bvh
+	{
+	public:
+		unsigned add_bottom_level(std::shared_ptr<bvh<VB>> bottom_level);
+		unsigned add_instance(unsigned bottom_level, const float4x4& object_to_world);
+		void set_transform(unsigned instance_id, const float4x4& object_to_world);
+		// Rebuilds the top-level tree only, the bottom levels stay as they are
+		void build();
+		// Updates the instance bounds after the bottom levels changed
+		void refit();
+
+		// A single untransformed instance, traced without the top level
+		bool is_single_level() const;
+		triangle<VB> get_world_triangle(const triangle<VB>& object_triangle,
+										unsigned instance_id) const;
+		triangle_geometry get_world_geometry(const triangle_geometry& object_geometry,
+											 unsigned instance_id) const;
+
+		const std::vector<std::shared_ptr<bvh<VB>>>& get_bottom_levels() const;
+		const std::vector<instance>& get_instances() const;
+		const bvh<VB>& get_tree() const;
+		const std::vector<unsigned>& get_leaf_instances() const;
+
+	protected:
+		void update_bounds(instance& placement) const;
+
+		std::vector<std::shared_ptr<bvh<VB>>> bottom_levels;
+		std::vector<instance> instances;
+		bvh<VB> tree;
+		// Instance ids in the order the tree leaves reference them
+		std::vector<unsigned> leaf_instances;
+	};
 
-		float3 aabb_min;
-		float3 aabb_max;
+	// Outcome of shading one hit in the wavefront integrator
+	struct scatter_result
+	{
+		float3 emitted{0.f, 0.f, 0.f};
+		// Continuation ray and the factor it applies to the path throughput
+		bool scattered = false;
+		ray next_ray;
+		float3 attenuation{1.f, 1.f, 1.f};
+		// Optional shadow connection adding radiance when nothing blocks it before max_t
+		bool connect = false;
+		ray shadow_ray;
+		float shadow_max_t = 0.f;
+		float3 shadow_radiance{0.f, 0.f, 0.f};
+	};
+
+	// Paths in flight, stored as one array per field
+	struct path_queue
+	{
+		void resize(size_t capacity);
+
+		std::vector<ray> rays;
+		std::vector<float3> throughputs;
+		std::vector<unsigned> pixel_ids;
+		std::vector<sampler> samplers;
+		std::vector<float> hit_t;
+		std::vector<float3> hit_bary;
+		// Index into the triangles of the hit instance's bottom level, or no_hit
+		std::vector<unsigned> hit_triangles;
+		std::vector<unsigned> hit_instances;
+		std::atomic<size_t> size{0};
+
+		static constexpr unsigned no_hit = std::numeric_limits<unsigned>::max();
+	};
+
+	struct shadow_queue
+	{
+		void resize(size_t capacity);
+
+		std::vector<ray> rays;
+		std::vector<float> max_t;
+		std::vector<float3> radiance;
+		std::vector<unsigned> pixel_ids;
+		std::atomic<size_t> size{0};
+	};
+
+	enum class integrator_mode
+	{
+		// Every path recurses through closest_hit_shader on its own thread
+		recursive,
+		// Paths of a frame advance bounce by bounce through scatter_shader
+		wavefront
+	};
+
+	// Time spent on an image tile during the last ray_generation, summed over frames
+	struct tile_timing
+	{
+		size_t x;
+		size_t y;
+		size_t width;
+		size_t height;
+		float milliseconds;
 	};
 
 	struct light
@@ -92,6 +566,43 @@ namespace cg::renderer
 		float3 color;
 	};
 
+	// Emissive triangle of the scene in world space, sampled as an area light
+	struct emissive_triangle
+	{
+		triangle_geometry geometry;
+		float3 emissive;
+		float area;
+	};
+
+	// Point on a light seen from a shaded point. The radiance is divided by
+	// the pdf of the sample in solid angle
+	struct light_sample
+	{
+		float3 direction;
+		float distance;
+		float3 radiance;
+	};
+
+	// How the samples a shader writes to an output variable make its pixel
+	enum class aov_filter
+	{
+		// Mean over the pixel's samples, for depth, normals or albedo
+		average,
+		// Value of the last write, for ids that mustn't blend
+		last,
+		// Total over the pixel's samples, for counts
+		sum
+	};
+
+	// Arbitrary output variable: a named image the shaders write during
+	// ray_generation next to the color
+	struct aov
+	{
+		std::string name;
+		aov_filter filter;
+		std::shared_ptr<cg::resource<float3>> buffer;
+	};
+
 	template<typename VB, typename RT>
 	class raytracer
 	{
@@ -108,15 +619,86 @@ namespace cg::renderer
 		void
 		set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>>
 								  in_index_buffers);
+		void set_build_mode(bvh_build_mode in_build_mode);
+		void set_integrator(integrator_mode in_integrator);
+		// Paths that have bounced this many times end by Russian roulette,
+		// zero keeps them going to the full depth
+		void set_roulette_depth(unsigned in_roulette_depth);
+		// Sequence behind pixel jitter and every shader's random numbers
+		void set_sampler(sampler_type in_sampler_mode);
+		// A-trous iterations run over the image after ray_generation, zero
+		// leaves it unfiltered
+		void set_denoise_iterations(unsigned in_iterations);
+		// Places the shape with its own bottom-level BVH. Shapes without
+		// instances are baked together in world space
+		unsigned add_instance(unsigned shape_id, const float4x4& object_to_world);
+		void set_instance_transform(unsigned instance_id, const float4x4& object_to_world);
 		void build_acceleration_structure();
-		std::vector<aabb<VB>> acceleration_structures;
+		// Moves the acceleration structure to the current vertex positions,
+		// which must keep the topology it was built with. With a positive
+		// rebuild_threshold, bottom levels whose SAH cost grew by more than
+		// that factor since their build are rebuilt instead.
+		void refit_acceleration_structure(float rebuild_threshold = 0.f);
+		// Refits a copy of every bottom level to deformed positions and
+		// traces ray_count random rays through it and through a fresh build
+		// over the same positions. Returns how many closest hits disagree.
+		size_t validate_refit(size_t ray_count) const;
+		// Fires ray_count random rays at the triangle blocks of every bottom
+		// level and compares the SIMD block kernel with the scalar
+		// intersection shader. Returns how many rays they disagree on.
+		size_t validate_triangle_kernel(size_t ray_count) const;
+		// Only scenes without instances are cached, loading one fails
+		bool load_acceleration_structure(const std::filesystem::path& cache_path, uint64_t key);
+		void save_acceleration_structure(const std::filesystem::path& cache_path, uint64_t key) const;
+		std::shared_ptr<top_level_bvh<VB>> acceleration_structure;
+
+		// Adaptive sampling stops sampling a pixel once the relative standard
+		// error of its mean drops below target_noise, and stops the render
+		// after sample_budget samples per pixel on average. Zero disables
+		// either limit; accumulation_num still caps the samples of a pixel.
+		void set_adaptive_sampling(float target_noise, float sample_budget);
 
 		void ray_generation(float3 position, float3 direction, float3 right,
 							float3 up, size_t depth, size_t accumulation_num);
 
+		// ray_generation hands the image so far to preview_callback every
+		// frames passes or once seconds have passed since the last preview,
+		// whichever comes first. Zero disables either.
+		void set_preview_interval(unsigned frames, float seconds);
+		// Gets the unfiltered image scaled to the brightness of the finished
+		// render, on the tracing thread, so it should only hand it on
+		std::function<void(std::vector<float3>&& image)> preview_callback = nullptr;
+
+		// ray_generation saves its accumulation state to cache_path every
+		// frames passes or seconds, whichever comes first, and once more when
+		// it is done. The key identifies the scene and settings the state
+		// belongs to. An empty path disables checkpoints.
+		void set_checkpoint(const std::filesystem::path& cache_path, uint64_t key,
+							unsigned frames, float seconds);
+		// Makes the next ray_generation continue from the checkpoint, which
+		// gives the same image as an uninterrupted run. Without a checkpoint
+		// it starts over, one from another render is an error
+		void set_resume(bool in_resume);
+
 		payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f,
 						  float min_t = 0.001f) const;
-		payload intersection_shader(const triangle<VB>& triangle,
+		// Hands the path's random numbers to the shaders through the payload
+		payload trace_ray(const ray& ray, size_t depth, const sampler& path_sampler,
+						  float max_t = 1000.f, float min_t = 0.001f) const;
+		// Continues a path whose attenuations so far multiply to throughput,
+		// which Russian roulette uses to decide whether it goes on
+		payload trace_ray(const ray& ray, size_t depth, const sampler& path_sampler,
+						  float3 throughput, float max_t = 1000.f, float min_t = 0.001f) const;
+		void trace_packet(const ray* rays, const sampler* samplers, unsigned ray_count,
+						  payload* results, size_t depth, float max_t = 1000.f,
+						  float min_t = 0.001f) const;
+		bool occluded(const ray& ray, float max_t, float min_t = 0.001f) const;
+		// Takes the point lights and collects the emissive triangles of the
+		// acceleration structure, so set it first and call again after it changes
+		void set_lights(const std::vector<light>& in_lights);
+		// Picks a light in proportion to its power, then a point on it
+		bool sample_light(float3 position, sampler& random, light_sample& sample) const;
+		payload intersection_shader(const triangle_geometry& geometry,
 									const ray& ray) const;
 
 		std::function<payload(const ray& ray)> miss_shader = nullptr;
@@ -126,15 +708,180 @@ namespace cg::renderer
 		std::function<payload(const ray& ray, payload& payload,
 							  const triangle<VB>& triangle)>
 				any_hit_shader = nullptr;
+		std::function<scatter_result(const ray& ray, payload& payload,
+									 const triangle<VB>& triangle, size_t depth)>
+				scatter_shader = nullptr;
+
+		const std::vector<tile_timing>& get_tile_timings() const;
+
+		// Output variables are cleared by every ray_generation call and
+		// resolved at its end
+		unsigned add_aov(const std::string& name, aov_filter filter = aov_filter::average);
+		size_t get_aov_count() const;
+		const aov& get_aov(unsigned aov_id) const;
+		// Adds the value to the output variable at the payload's pixel. Any
+		// shader may call it at any bounce, a pixel is only traced by one
+		// thread at a time. Rays traced without a pixel write nothing.
+		void write_aov(unsigned aov_id, const payload& payload, float3 value);
 
-		float2 get_jitter(int frame_id);
+		// First-hit normal, diffuse albedo and distance of each pixel center,
+		// written by ray_generation when it denoises and null before that.
+		// Misses leave zeros.
+		std::shared_ptr<cg::resource<float3>> get_normal_buffer() const;
+		std::shared_ptr<cg::resource<float3>> get_albedo_buffer() const;
+		std::shared_ptr<cg::resource<float>> get_depth_buffer() const;
 
 	protected:
 		std::shared_ptr<cg::resource<RT>> render_target;
 		std::shared_ptr<cg::resource<float3>> history;
+		std::shared_ptr<cg::resource<float3>> normal_buffer;
+		std::shared_ptr<cg::resource<float3>> albedo_buffer;
+		std::shared_ptr<cg::resource<float>> depth_buffer;
+		atrous_denoiser denoiser;
+		std::vector<aov> aovs;
+		void clear_aovs();
+		void resolve_aovs();
+		void trace_auxiliary(float3 position, float3 direction, float3 right, float3 up);
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::shared_ptr<cg::resource<VB>>> vertex_buffers;
 		std::vector<triangle<VB>> triangles;
+		bvh_build_mode build_mode = bvh_build_mode::sah;
+		integrator_mode integrator = integrator_mode::recursive;
+		unsigned roulette_depth = 0;
+		sampler_type sampler_mode = sampler_type::random;
+		// Below one, so even bright paths end eventually
+		static constexpr float max_survival_probability = 0.95f;
+		// Survival probability of a path about to bounce, drawing from random
+		// once roulette applies. Zero ends the path.
+		float roulette(sampler& random, float3 throughput) const;
+		std::vector<unsigned> instance_shapes;
+		std::vector<float4x4> instance_transforms;
+
+		// Shapes baked into each bottom level, in build order
+		std::vector<std::vector<unsigned>> bottom_level_shapes;
+		// A loaded structure bakes every shape of the buffers set by the time
+		// of a refit, which may come after the load
+		bool acceleration_structure_loaded = false;
+
+		std::shared_ptr<bvh<VB>> build_bottom_level(const std::vector<unsigned>& shape_ids);
+		void gather_triangles(const std::vector<unsigned>& shape_ids,
+							  std::vector<triangle_geometry>& shape_geometry,
+							  std::vector<triangle<VB>>& shape_triangles) const;
+
+		float3 get_primary_direction(float3 direction, float3 right, float3 up,
+									 float2 jitter, size_t x, size_t y) const;
+		void trace_wavefront(float3 position, float3 direction, float3 right,
+							 float3 up, size_t depth);
+		void extend_paths();
+		void shade_paths(size_t bounce, size_t depth);
+		void connect_paths();
+
+		std::vector<float3> frame_radiance;
+		path_queue paths;
+		path_queue next_paths;
+		shadow_queue shadow_rays;
+
+		bool closest_hit(const ray& ray, float min_t, payload& best_hit,
+						 const triangle<VB>*& hit_triangle, unsigned& hit_instance,
+						 bool stop_at_first_hit) const;
+		bool closest_hit(const bvh<VB>& bottom_level, const ray& ray, float min_t,
+						 payload& best_hit, const triangle<VB>*& hit_triangle,
+						 bool stop_at_first_hit, traversal_entry root = {0, 0, 0.f}) const;
+		bool occluded(const bvh<VB>& bottom_level, const ray& ray, float max_t, float min_t) const;
+		static void push_hit_children(const wide_bvh_node& node, unsigned hit_mask,
+									  const float* t_near, traversal_entry* stack,
+									  size_t& stack_size);
+		bool block_hit_matches(const triangle_block& block, const ray& ray, float min_t,
+							   float max_t, int lane, float t, float u, float v) const;
+
+		std::vector<tile_timing> tile_timings;
+		void trace_tile(const cg::utils::tile_scheduler::tile& tile, float3 position,
+						float3 direction, float3 right, float3 up, size_t depth);
+		void trace_pass(float3 position, float3 direction, float3 right, float3 up,
+						size_t depth, cg::utils::tile_scheduler& scheduler);
+		void trace_adaptive(float3 position, float3 direction, float3 right, float3 up,
+							size_t depth, size_t accumulation_num,
+							cg::utils::tile_scheduler& scheduler);
+		void accumulate_sample(size_t pixel_id, float3 color);
+		float get_relative_error(size_t pixel_id) const;
+		static float luminance(float3 color);
+
+		float inv_accum = 1.f;
+
+		unsigned preview_frames = 0;
+		float preview_seconds = 0.f;
+		std::chrono::steady_clock::time_point last_preview;
+		// Publishes a preview if one is due after the given number of passes
+		void update_preview(size_t passes, size_t accumulation_num);
+		static bool interval_due(unsigned frames, float seconds, size_t passes,
+								 std::chrono::steady_clock::time_point& last);
+
+		// Where ray_generation is, all a checkpoint needs besides the buffers
+		struct accumulation_progress
+		{
+			uint64_t passes;
+			uint64_t traced_samples;
+			uint64_t remaining_samples;
+		};
+		accumulation_progress progress{};
+
+		struct checkpoint_header
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t sampler;
+			uint64_t key;
+			uint64_t width;
+			uint64_t height;
+			uint64_t accumulation_num;
+			uint32_t adaptive;
+			uint32_t aov_count;
+			accumulation_progress progress;
+		};
+		static constexpr char checkpoint_magic[8] = "CGCKPT";
+		static constexpr uint32_t checkpoint_version = 2;
+
+		std::filesystem::path checkpoint_path;
+		uint64_t checkpoint_key = 0;
+		unsigned checkpoint_frames = 0;
+		float checkpoint_seconds = 0.f;
+		std::chrono::steady_clock::time_point last_checkpoint;
+		bool resume = false;
+		void update_checkpoint(size_t accumulation_num);
+		void save_checkpoint(size_t accumulation_num) const;
+		bool load_checkpoint(size_t accumulation_num);
+
+		// Samples taken by each pixel in the current ray_generation call. A
+		// pass samples the pixels flagged in active_pixels, listed in
+		// active_pixel_ids
+		std::vector<uint32_t> sample_counts;
+		std::vector<uint8_t> active_pixels;
+		std::vector<unsigned> active_pixel_ids;
+
+		std::vector<light> lights;
+		std::vector<emissive_triangle> emissive_triangles;
+		// Cumulative selection probabilities of the point lights followed by
+		// the emissive triangles
+		std::vector<float> light_cdf;
+
+		bool adaptive = false;
+		float adaptive_target_noise = 0.f;
+		float adaptive_sample_budget = 0.f;
+		// Running mean of each pixel's samples and the sum of squared
+		// luminance deviations from it
+		std::vector<float3> sample_means;
+		std::vector<float> sample_deviations;
+		// Samples every pixel takes before its variance estimate is trusted
+		static constexpr uint32_t adaptive_min_samples = 4;
+
+		// The recursive integrator works on tile_size x tile_size pixel tiles,
+		// scheduled in Morton order
+		static constexpr size_t tile_size = 16;
+		// Primary rays are traced in packet_size x packet_size pixel packets
+		static constexpr unsigned packet_size = 4;
+		static constexpr unsigned max_packet_rays = packet_size * packet_size;
+		// Packets whose active rays drop to this count continue ray by ray
+		static constexpr unsigned packet_divergence_threshold = 2;
 
 		size_t width = 1920;
 		size_t height = 1080;
@@ -154,6 +901,10 @@ namespace cg::renderer
 		width = in_width;
 
 		history = std::make_shared<cg::resource<float3>>(width, height);
+		// Allocated by the first ray_generation that denoises
+		normal_buffer = nullptr;
+		albedo_buffer = nullptr;
+		depth_buffer = nullptr;
 	}
 
 	template<typename VB, typename RT>
@@ -180,202 +931,3273 @@ namespace cg::renderer
 	}
 
 	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::build_acceleration_structure()
+	inline void raytracer<VB, RT>::set_build_mode(bvh_build_mode in_build_mode)
+	{
+		build_mode = in_build_mode;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_integrator(integrator_mode in_integrator)
 	{
-		acceleration_structures.clear();
-		acceleration_structures.reserve(index_buffers.size());
+		integrator = in_integrator;
+	}
 
-		for (size_t shape_id = 0; shape_id < index_buffers.size(); shape_id++) {
-			auto& indices = index_buffers[shape_id];
-			auto& vertices = vertex_buffers[shape_id];
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_roulette_depth(unsigned in_roulette_depth)
+	{
+		roulette_depth = in_roulette_depth;
+	}
 
-			aabb<VB> bounding_box;
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_sampler(sampler_type in_sampler_mode)
+	{
+		sampler_mode = in_sampler_mode;
+	}
 
-			const size_t triangle_count = indices->get_number_of_elements() / 3;
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_preview_interval(unsigned frames, float seconds)
+	{
+		preview_frames = frames;
+		preview_seconds = seconds;
+	}
 
-			for (size_t tri_idx = 0; tri_idx < triangle_count; tri_idx++) {
-				const size_t base_idx = tri_idx * 3;
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_checkpoint(const std::filesystem::path& cache_path,
+												  uint64_t key, unsigned frames, float seconds)
+	{
+		checkpoint_path = cache_path;
+		checkpoint_key = key;
+		checkpoint_frames = frames;
+		checkpoint_seconds = seconds;
+	}
 
-				const auto& vertex_a = vertices->item(indices->item(base_idx));
-				const auto& vertex_b = vertices->item(indices->item(base_idx + 1));
-				const auto& vertex_c = vertices->item(indices->item(base_idx + 2));
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_resume(bool in_resume)
+	{
+		resume = in_resume;
+	}
 
-				triangle<VB> current_triangle(vertex_a, vertex_b, vertex_c);
-				bounding_box.add_triangle(current_triangle);
-			}
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_denoise_iterations(unsigned in_iterations)
+	{
+		denoiser.set_iterations(in_iterations);
+	}
 
-			acceleration_structures.push_back(bounding_box);
-		}
+	template<typename VB, typename RT>
+	inline std::shared_ptr<cg::resource<float3>> raytracer<VB, RT>::get_normal_buffer() const
+	{
+		return normal_buffer;
 	}
+
 	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::ray_generation(float3 position, float3 direction,
-												  float3 right, float3 up,
-												  size_t depth,
-												  size_t accumulation_num)
+	inline std::shared_ptr<cg::resource<float3>> raytracer<VB, RT>::get_albedo_buffer() const
 	{
-		float inv_accum = 1.f / static_cast<float>(accumulation_num);
+		return albedo_buffer;
+	}
 
-		for (int frame = 0; frame < accumulation_num; frame++) {
-			std::cout << "Tracing frame #" << frame + 1 << "\n";
-			float2 jitter = get_jitter(frame);
+	template<typename VB, typename RT>
+	inline std::shared_ptr<cg::resource<float>> raytracer<VB, RT>::get_depth_buffer() const
+	{
+		return depth_buffer;
+	}
 
-#pragma omp parallel for
-			for (int x = 0; x < width; x++) {
-				for (int y = 0; y < height; y++) {
-					float u = (2.f * x + jitter.x) / static_cast<float>(width - 1) - 1.f;
-					float v = (2.f * y + jitter.y) / static_cast<float>(height - 1) - 1.f;
-					u *= static_cast<float>(width) / static_cast<float>(height);
+	template<typename VB, typename RT>
+	inline unsigned raytracer<VB, RT>::add_aov(const std::string& name, aov_filter filter)
+	{
+		aovs.push_back({name, filter, std::make_shared<cg::resource<float3>>(width, height)});
+		return static_cast<unsigned>(aovs.size() - 1);
+	}
 
-					float3 ray_dir = direction + u * right - v * up;
-					ray current_ray(position, ray_dir);
+	template<typename VB, typename RT>
+	inline size_t raytracer<VB, RT>::get_aov_count() const
+	{
+		return aovs.size();
+	}
 
-					payload hit_result = trace_ray(current_ray, depth);
+	template<typename VB, typename RT>
+	inline const aov& raytracer<VB, RT>::get_aov(unsigned aov_id) const
+	{
+		return aovs[aov_id];
+	}
 
-					auto& pixel_history = history->item(x, y);
-					pixel_history += sqrt(hit_result.color.to_float3() * inv_accum);
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::write_aov(unsigned aov_id, const payload& payload, float3 value)
+	{
+		if (!payload.random.has_pixel())
+			return;
+		auto& target = aovs[aov_id].buffer->item(payload.random.get_pixel_id());
+		if (aovs[aov_id].filter == aov_filter::last)
+			target = value;
+		else
+			target += value;
+	}
 
-					if (frame == accumulation_num - 1)
-						render_target->item(x, y) = RT::from_float3(pixel_history);
-				}
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::clear_aovs()
+	{
+		for (auto& output: aovs) {
+			if (output.buffer->get_number_of_elements() != width * height) {
+				output.buffer = std::make_shared<cg::resource<float3>>(width, height);
+				continue;
 			}
+			for (size_t i = 0; i < output.buffer->get_number_of_elements(); i++)
+				output.buffer->item(i) = float3{0.f, 0.f, 0.f};
 		}
 	}
 
+	// Averaged outputs are divided by the samples each pixel took
 	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::trace_ray(const ray& ray, size_t depth,
-												float max_t, float min_t) const
+	inline void raytracer<VB, RT>::resolve_aovs()
 	{
-		if (depth == 0)
-			return miss_shader(ray);
-
-		size_t next_depth = depth - 1;
-
-		payload best_hit{};
-		best_hit.t = max_t;
-		const triangle<VB>* hit_triangle = nullptr;
-
-		for (auto& bounding_box: acceleration_structures) {
-			if (!bounding_box.aabb_test(ray))
+		for (auto& output: aovs) {
+			if (output.filter != aov_filter::average)
 				continue;
-
-			for (auto& tri: bounding_box.get_triangles()) {
-				payload current_hit = intersection_shader(tri, ray);
-
-				if (current_hit.t > min_t && current_hit.t < best_hit.t) {
-					best_hit = current_hit;
-					hit_triangle = &tri;
-
-					if (any_hit_shader)
-						return any_hit_shader(ray, current_hit, tri);
-				}
+#pragma omp parallel for
+			for (int pixel_id = 0; pixel_id < static_cast<int>(width * height); pixel_id++) {
+				const uint32_t count = std::max(sample_counts[pixel_id], 1u);
+				output.buffer->item(pixel_id) /= static_cast<float>(count);
 			}
 		}
+	}
 
-		if (hit_triangle && closest_hit_shader)
-			return closest_hit_shader(ray, best_hit, *hit_triangle, next_depth);
+	template<typename VB, typename RT>
+	inline unsigned raytracer<VB, RT>::add_instance(unsigned shape_id,
+													const float4x4& object_to_world)
+	{
+		instance_shapes.push_back(shape_id);
+		instance_transforms.push_back(object_to_world);
+		return static_cast<unsigned>(instance_shapes.size() - 1);
+	}
 
-		return miss_shader(ray);
+	// Moving an instance rebuilds the small top-level tree only
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_instance_transform(unsigned instance_id,
+														  const float4x4& object_to_world)
+	{
+		instance_transforms[instance_id] = object_to_world;
+		if (!acceleration_structure)
+			return;
+		acceleration_structure->set_transform(instance_id, object_to_world);
+		acceleration_structure->build();
 	}
 
 	template<typename VB, typename RT>
-	inline payload
-	raytracer<VB, RT>::intersection_shader(const triangle<VB>& triangle,
-										   const ray& ray) const
+	inline std::shared_ptr<bvh<VB>>
+	raytracer<VB, RT>::build_bottom_level(const std::vector<unsigned>& shape_ids)
 	{
-		payload result{};
-		result.t = -1.f;
+		std::vector<triangle_geometry> shape_geometry;
+		std::vector<triangle<VB>> shape_triangles;
+		gather_triangles(shape_ids, shape_geometry, shape_triangles);
+		bottom_level_shapes.push_back(shape_ids);
 
-		float3 edge1 = triangle.ba;
-		float3 edge2 = triangle.ca;
-		float3 h = cross(ray.direction, edge2);
+		auto bottom_level = std::make_shared<bvh<VB>>();
+		bottom_level->build(std::move(shape_geometry), std::move(shape_triangles), build_mode);
+		return bottom_level;
+	}
 
-		float determinant = dot(edge1, h);
-		if (determinant > -1e-8 && determinant < 1e-8)
-			return result;
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::gather_triangles(const std::vector<unsigned>& shape_ids,
+													std::vector<triangle_geometry>& shape_geometry,
+													std::vector<triangle<VB>>& shape_triangles) const
+	{
+		std::vector<size_t> shape_offsets(shape_ids.size() + 1, 0);
+		for (size_t i = 0; i < shape_ids.size(); i++)
+			shape_offsets[i + 1] = shape_offsets[i] +
+								   index_buffers[shape_ids[i]]->get_number_of_elements() / 3;
 
-		float inv_determinant = 1.f / determinant;
-		float3 s = ray.position - triangle.a;
+		shape_geometry.resize(shape_offsets.back());
+		shape_triangles.resize(shape_offsets.back());
+		for (size_t i = 0; i < shape_ids.size(); i++) {
+			auto& indices = index_buffers[shape_ids[i]];
+			auto& vertices = vertex_buffers[shape_ids[i]];
 
-		float u_coord = dot(s, h) * inv_determinant;
-		if (u_coord < 0.f || u_coord > 1.f)
-			return result;
+			const int triangle_count = static_cast<int>(shape_offsets[i + 1] - shape_offsets[i]);
 
-		float3 q = cross(s, edge1);
-		float v_coord = dot(ray.direction, q) * inv_determinant;
-		if (v_coord < 0.f || u_coord + v_coord > 1.f)
-			return result;
+#pragma omp parallel for
+			for (int tri_idx = 0; tri_idx < triangle_count; tri_idx++) {
+				const size_t base_idx = static_cast<size_t>(tri_idx) * 3;
 
-		result.t = dot(edge2, q) * inv_determinant;
-		result.bary = float3{1.f - u_coord - v_coord, u_coord, v_coord};
+				const auto& vertex_a = vertices->item(indices->item(base_idx));
+				const auto& vertex_b = vertices->item(indices->item(base_idx + 1));
+				const auto& vertex_c = vertices->item(indices->item(base_idx + 2));
 
-		return result;
+				shape_geometry[shape_offsets[i] + tri_idx] =
+						triangle_geometry(vertex_a, vertex_b, vertex_c);
+				shape_triangles[shape_offsets[i] + tri_idx] =
+						triangle<VB>(vertex_a, vertex_b, vertex_c);
+				shape_triangles[shape_offsets[i] + tri_idx].shape_id = shape_ids[i];
+			}
+		}
 	}
 
 	template<typename VB, typename RT>
-	float2 raytracer<VB, RT>::get_jitter(int frame_id)
+	inline void raytracer<VB, RT>::build_acceleration_structure()
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+
+		acceleration_structure = std::make_shared<top_level_bvh<VB>>();
+		bottom_level_shapes.clear();
+		acceleration_structure_loaded = false;
+
+		// Every instanced shape is built once, however many times it is placed
+		const unsigned no_bottom_level = std::numeric_limits<unsigned>::max();
+		std::vector<unsigned> shape_bottom_levels(index_buffers.size(), no_bottom_level);
+		for (unsigned shape_id: instance_shapes) {
+			if (shape_bottom_levels[shape_id] == no_bottom_level)
+				shape_bottom_levels[shape_id] =
+						acceleration_structure->add_bottom_level(build_bottom_level({shape_id}));
+		}
+		for (size_t instance_id = 0; instance_id < instance_shapes.size(); instance_id++)
+			acceleration_structure->add_instance(shape_bottom_levels[instance_shapes[instance_id]],
+												 instance_transforms[instance_id]);
+
+		std::vector<unsigned> baked_shapes;
+		for (unsigned shape_id = 0; shape_id < index_buffers.size(); shape_id++) {
+			if (shape_bottom_levels[shape_id] == no_bottom_level)
+				baked_shapes.push_back(shape_id);
+		}
+		if (!baked_shapes.empty())
+			acceleration_structure->add_instance(
+					acceleration_structure->add_bottom_level(build_bottom_level(baked_shapes)),
+					identity_transform());
+
+		acceleration_structure->build();
+
+		size_t node_count = 0;
+		for (const auto& bottom_level: acceleration_structure->get_bottom_levels())
+			node_count += bottom_level->get_nodes().size();
+
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> duration = stop - start;
+		std::cout << "Acceleration structure build time: " << duration.count() << "ms, "
+				  << node_count << " nodes, "
+				  << acceleration_structure->get_instances().size() << " instances\n";
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::refit_acceleration_structure(float rebuild_threshold)
+	{
+		if (!acceleration_structure)
+			return build_acceleration_structure();
+
+		auto start = std::chrono::high_resolution_clock::now();
+
+		if (index_buffers.empty())
+			THROW_ERROR("Refit needs the vertex and index buffers of the scene");
+		if (acceleration_structure_loaded) {
+			bottom_level_shapes.assign(1, std::vector<unsigned>(index_buffers.size()));
+			std::iota(bottom_level_shapes[0].begin(), bottom_level_shapes[0].end(), 0u);
+		}
+
+		const auto& bottom_levels = acceleration_structure->get_bottom_levels();
+		if (bottom_level_shapes.size() != bottom_levels.size())
+			THROW_ERROR("Acceleration structure was not built from these vertex buffers");
+
+		unsigned rebuilt_count = 0;
+		for (size_t level_id = 0; level_id < bottom_levels.size(); level_id++) {
+			std::vector<triangle_geometry> shape_geometry;
+			std::vector<triangle<VB>> shape_triangles;
+			gather_triangles(bottom_level_shapes[level_id], shape_geometry, shape_triangles);
+
+			bvh<VB>& bottom_level = *bottom_levels[level_id];
+			if (shape_triangles.size() != bottom_level.get_triangles().size())
+				THROW_ERROR("Refit needs the topology the acceleration structure was built with");
+
+			bottom_level.refit(shape_geometry, shape_triangles);
+			if (rebuild_threshold > 0.f &&
+				bottom_level.get_sah_cost() > bottom_level.get_build_sah_cost() * rebuild_threshold) {
+				bottom_level.build(std::move(shape_geometry), std::move(shape_triangles), build_mode);
+				rebuilt_count++;
+			}
+		}
+		acceleration_structure->refit();
+
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> duration = stop - start;
+		std::cout << "Acceleration structure refit time: " << duration.count() << "ms, "
+				  << rebuilt_count << " bottom levels rebuilt\n";
+	}
+
+	template<typename VB, typename RT>
+	inline size_t raytracer<VB, RT>::validate_refit(size_t ray_count) const
+	{
+		if (!acceleration_structure)
+			return 0;
+
+		int64_t mismatches = 0;
+		const auto& bottom_levels = acceleration_structure->get_bottom_levels();
+		for (size_t level_id = 0; level_id < bottom_levels.size(); level_id++) {
+			const std::vector<triangle_geometry> geometry = bottom_levels[level_id]->get_triangle_geometry();
+			const auto stored_triangles = bottom_levels[level_id]->get_triangles();
+			if (geometry.empty())
+				continue;
+			const std::vector<triangle<VB>> level_triangles(stored_triangles.begin(), stored_triangles.end());
+
+			aabb bounds;
+			for (const triangle_geometry& source: geometry) {
+				bounds.add_point(source.a);
+				bounds.add_point(source.a + source.ba);
+				bounds.add_point(source.a + source.ca);
+			}
+			const float3 extent = bounds.aabb_max - bounds.aabb_min;
+			const float amplitude = 0.05f * maxelem(extent);
+
+			// A smooth warp, so neighbouring triangles move alike
+			auto deform = [&](float3 point) {
+				const float3 phase = 6.f * (point - bounds.aabb_min) / (extent + 1e-6f);
+				return point + amplitude * float3{std::sin(phase.y), std::sin(phase.z), std::sin(phase.x)};
+			};
+			std::vector<triangle_geometry> moved(geometry.size());
+			for (size_t i = 0; i < geometry.size(); i++) {
+				const float3 a = deform(geometry[i].a);
+				moved[i].a = a;
+				moved[i].ba = deform(geometry[i].a + geometry[i].ba) - a;
+				moved[i].ca = deform(geometry[i].a + geometry[i].ca) - a;
+			}
+
+			bvh<VB> refitted;
+			refitted.build(geometry, level_triangles, build_mode);
+			refitted.refit(moved, level_triangles);
+			bvh<VB> rebuilt;
+			rebuilt.build(moved, level_triangles, build_mode);
+
+#pragma omp parallel for reduction(+ : mismatches)
+			for (int64_t ray_id = 0; ray_id < static_cast<int64_t>(ray_count); ray_id++) {
+				sampler random(static_cast<uint32_t>(ray_id), static_cast<uint32_t>(level_id));
+				const float3 origin = bounds.aabb_min + extent * float3{random.next_float(), random.next_float(),
+																		 random.next_float()};
+				const float2 u = random.next_float2();
+				const float z = 1.f - 2.f * u.x;
+				const float radius = std::sqrt(std::max(0.f, 1.f - z * z));
+				const float phi = 2.f * pi * u.y;
+				const cg::renderer::ray probe(origin, float3{radius * std::cos(phi), radius * std::sin(phi), z});
+
+				payload refitted_hit{};
+				payload rebuilt_hit{};
+				refitted_hit.t = rebuilt_hit.t = std::numeric_limits<float>::max();
+				const triangle<VB>* refitted_triangle = nullptr;
+				const triangle<VB>* rebuilt_triangle = nullptr;
+				closest_hit(refitted, probe, 0.001f, refitted_hit, refitted_triangle, false);
+				closest_hit(rebuilt, probe, 0.001f, rebuilt_hit, rebuilt_triangle, false);
+				if ((refitted_triangle == nullptr) != (rebuilt_triangle == nullptr) ||
+					(refitted_triangle &&
+					 std::abs(refitted_hit.t - rebuilt_hit.t) > 1e-4f * std::max(1.f, rebuilt_hit.t)))
+					mismatches++;
+			}
+		}
+		return static_cast<size_t>(mismatches);
+	}
+
+	// Rays are aimed at a random point of a random lane from anywhere around
+	// the bottom level, with a random interval end, so the kernel sees hits
+	// in front of and past max_t, grazing hits and misses
+	template<typename VB, typename RT>
+	inline size_t raytracer<VB, RT>::validate_triangle_kernel(size_t ray_count) const
+	{
+		if (!acceleration_structure)
+			return 0;
+
+		int64_t mismatches = 0;
+		const auto& bottom_levels = acceleration_structure->get_bottom_levels();
+		for (size_t level_id = 0; level_id < bottom_levels.size(); level_id++) {
+			const auto& blocks = bottom_levels[level_id]->get_triangle_blocks();
+			if (blocks.empty())
+				continue;
+
+			aabb bounds;
+			for (const triangle_block& block: blocks) {
+				for (unsigned lane = 0; lane < triangle_block_width; lane++) {
+					const triangle_geometry source = block.get_triangle(lane);
+					bounds.add_point(source.a);
+					bounds.add_point(source.a + source.ba);
+					bounds.add_point(source.a + source.ca);
+				}
+			}
+			const float3 extent = bounds.aabb_max - bounds.aabb_min;
+
+#pragma omp parallel for reduction(+ : mismatches)
+			for (int64_t ray_id = 0; ray_id < static_cast<int64_t>(ray_count); ray_id++) {
+				sampler random(static_cast<uint32_t>(ray_id), static_cast<uint32_t>(level_id));
+				const size_t block_id = std::min(static_cast<size_t>(random.next_float() * blocks.size()),
+												 blocks.size() - 1);
+				const triangle_block& block = blocks[block_id];
+				const unsigned target_lane = std::min(static_cast<unsigned>(random.next_float() * triangle_block_width),
+													  triangle_block_width - 1);
+				triangle_geometry target = block.get_triangle(target_lane);
+				// Unused lanes hold degenerate triangles, the first lane is always used
+				if (length2(cross(target.ba, target.ca)) == 0.f)
+					target = block.get_triangle(0);
+
+				float2 bary = random.next_float2();
+				if (bary.x + bary.y > 1.f)
+					bary = 1.f - bary;
+				const float3 origin = bounds.aabb_min - extent +
+									  3.f * extent * float3{random.next_float(), random.next_float(),
+															 random.next_float()};
+				const float3 to_target = target.a + bary.x * target.ba + bary.y * target.ca - origin;
+				const float distance = length(to_target);
+				if (distance <= 0.f)
+					continue;
+				const cg::renderer::ray probe(origin, to_target / distance);
+				const float max_t = random.next_float() < 0.5f ? std::numeric_limits<float>::max()
+															   : 2.f * distance * random.next_float();
+
+				float t, u, v;
+				const int lane = block.intersect(probe, 0.f, max_t, t, u, v);
+				if (!block_hit_matches(block, probe, 0.f, max_t, lane, t, u, v) ||
+					block.occluded(probe, 0.f, max_t) != (lane >= 0))
+					mismatches++;
+			}
+		}
+		return static_cast<size_t>(mismatches);
+	}
+
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::load_acceleration_structure(
+			const std::filesystem::path& cache_path, uint64_t key)
+	{
+		// The cache holds one bottom level baking every shape, which would
+		// drop the placements of add_instance
+		if (!instance_shapes.empty()) {
+			std::cerr << "Instanced scenes aren't cached, ignoring " << cache_path << "\n";
+			return false;
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+
+		auto cached_structure = std::make_shared<bvh<VB>>();
+		if (!cached_structure->load(cache_path, key))
+			return false;
+
+		// A cached structure always bakes every shape, in order
+		bottom_level_shapes.clear();
+		acceleration_structure_loaded = true;
+
+		acceleration_structure = std::make_shared<top_level_bvh<VB>>();
+		acceleration_structure->add_instance(
+				acceleration_structure->add_bottom_level(cached_structure),
+				identity_transform());
+		acceleration_structure->build();
+
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> duration = stop - start;
+		std::cout << "Acceleration structure load time: " << duration.count() << "ms, "
+				  << cached_structure->get_nodes().size() << " nodes\n";
+		return true;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::save_acceleration_structure(
+			const std::filesystem::path& cache_path, uint64_t key) const
+	{
+		// Only a scene baked into one bottom level is cached
+		if (!instance_shapes.empty()) {
+			std::cerr << "Instanced scenes aren't cached, not writing " << cache_path << "\n";
+			return;
+		}
+		if (acceleration_structure && acceleration_structure->is_single_level())
+			acceleration_structure->get_bottom_levels()[0]->save(cache_path, key);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_adaptive_sampling(float target_noise, float sample_budget)
+	{
+		adaptive_target_noise = target_noise;
+		adaptive_sample_budget = sample_budget;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::ray_generation(float3 position, float3 direction,
+												  float3 right, float3 up,
+												  size_t depth,
+												  size_t accumulation_num)
+	{
+		inv_accum = 1.f / static_cast<float>(accumulation_num);
+
+		const size_t pixel_count = width * height;
+		sample_counts.assign(pixel_count, 0);
+		active_pixels.assign(pixel_count, 1);
+		active_pixel_ids.resize(pixel_count);
+		std::iota(active_pixel_ids.begin(), active_pixel_ids.end(), 0u);
+
+		cg::utils::tile_scheduler scheduler(width, height, tile_size,
+											static_cast<unsigned>(omp_get_max_threads()));
+		// The wavefront integrator works on whole frames and has no tiles to time
+		tile_timings.resize(integrator == integrator_mode::wavefront ? 0 : scheduler.get_tile_count());
+		for (size_t tile_id = 0; tile_id < tile_timings.size(); tile_id++) {
+			const auto& tile = scheduler.get_tile(tile_id);
+			tile_timings[tile_id] = {tile.x_begin, tile.y_begin, tile.x_end - tile.x_begin,
+									 tile.y_end - tile.y_begin, 0.f};
+		}
+
+		// Only the denoiser reads the first-hit buffers
+		if (denoiser.get_iterations() > 0) {
+			if (!normal_buffer) {
+				normal_buffer = std::make_shared<cg::resource<float3>>(width, height);
+				albedo_buffer = std::make_shared<cg::resource<float3>>(width, height);
+				depth_buffer = std::make_shared<cg::resource<float>>(width, height);
+			}
+			trace_auxiliary(position, direction, right, up);
+		}
+		clear_aovs();
+		last_preview = std::chrono::steady_clock::now();
+		last_checkpoint = last_preview;
+
+		adaptive = adaptive_target_noise > 0.f || adaptive_sample_budget > 0.f;
+		if (adaptive) {
+			sample_means.assign(pixel_count, float3{0.f, 0.f, 0.f});
+			sample_deviations.assign(pixel_count, 0.f);
+		}
+		else {
+			sample_means.clear();
+			sample_deviations.clear();
+		}
+		progress = {0, 0,
+					adaptive_sample_budget > 0.f
+							? static_cast<uint64_t>(adaptive_sample_budget * pixel_count)
+							: std::numeric_limits<uint64_t>::max()};
+		if (resume) {
+			resume = false;
+			if (load_checkpoint(accumulation_num))
+				std::cout << "Resuming after pass #" << progress.passes << "\n";
+			else
+				std::cout << "No checkpoint at " << checkpoint_path << ", starting over\n";
+		}
+
+		if (adaptive) {
+			trace_adaptive(position, direction, right, up, depth, accumulation_num, scheduler);
+		}
+		else {
+			for (size_t frame = progress.passes; frame < accumulation_num; frame++) {
+				std::cout << "Tracing frame #" << frame + 1 << "\n";
+				trace_pass(position, direction, right, up, depth, scheduler);
+				progress.passes = frame + 1;
+				if (frame + 1 < accumulation_num) {
+					update_preview(frame + 1, accumulation_num);
+					update_checkpoint(accumulation_num);
+				}
+			}
+		}
+		// The finished state, which a resumed run resolves without tracing
+		if (!checkpoint_path.empty())
+			save_checkpoint(accumulation_num);
+
+		if (adaptive) {
+#pragma omp parallel for
+			for (int pixel_id = 0; pixel_id < static_cast<int>(pixel_count); pixel_id++) {
+				history->item(pixel_id) = sample_means[pixel_id];
+			}
+		}
+		resolve_aovs();
+
+		// The history keeps the raw linear estimate, only the render target is
+		// filtered and encoded
+		const float3* resolved = history->get_data();
+		std::vector<float3> denoised;
+		if (denoiser.get_iterations() > 0) {
+			auto denoise_start = std::chrono::high_resolution_clock::now();
+			denoiser.denoise(history->get_data(), normal_buffer->get_data(), albedo_buffer->get_data(),
+							 depth_buffer->get_data(), width, height, denoised);
+			resolved = denoised.data();
+			auto denoise_stop = std::chrono::high_resolution_clock::now();
+			std::chrono::duration<float, std::milli> denoise_duration = denoise_stop - denoise_start;
+			std::cout << "Denoising time: " << denoise_duration.count() << "ms\n";
+		}
+
+#pragma omp parallel for
+		for (int pixel_id = 0; pixel_id < static_cast<int>(pixel_count); pixel_id++)
+			render_target->item(pixel_id) = RT::from_linear(resolved[pixel_id]);
+	}
+
+	// Linear mean of the samples each pixel has taken so far
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::update_preview(size_t passes, size_t accumulation_num)
+	{
+		if (!preview_callback || !interval_due(preview_frames, preview_seconds, passes, last_preview))
+			return;
+
+		std::vector<float3> image(width * height);
+#pragma omp parallel for
+		for (int pixel_id = 0; pixel_id < static_cast<int>(image.size()); pixel_id++) {
+			const uint32_t count = sample_counts[pixel_id];
+			if (count == 0)
+				image[pixel_id] = float3{0.f, 0.f, 0.f};
+			else if (adaptive)
+				image[pixel_id] = sample_means[pixel_id];
+			else
+				image[pixel_id] = history->item(pixel_id) *
+								  (static_cast<float>(accumulation_num) / static_cast<float>(count));
+		}
+		preview_callback(std::move(image));
+	}
+
+	// Due every frames passes or once seconds have passed since last, which
+	// then restarts
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::interval_due(unsigned frames, float seconds, size_t passes,
+												std::chrono::steady_clock::time_point& last)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		const bool frames_due = frames > 0 && passes % frames == 0;
+		const bool time_due = seconds > 0.f && std::chrono::duration<float>(now - last).count() >= seconds;
+		if (!frames_due && !time_due)
+			return false;
+		last = now;
+		return true;
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::update_checkpoint(size_t accumulation_num)
+	{
+		if (checkpoint_path.empty() ||
+			!interval_due(checkpoint_frames, checkpoint_seconds, progress.passes, last_checkpoint))
+			return;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		save_checkpoint(accumulation_num);
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> duration = stop - start;
+		std::cout << "Checkpoint time: " << duration.count() << "ms\n";
+	}
+
+	// Everything a pass reads from earlier passes: the sums or running
+	// means, the sample counts the counter-based samplers continue from, and
+	// the unresolved output variables. Written next to the target and
+	// renamed, so a process killed while saving leaves the last checkpoint
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::save_checkpoint(size_t accumulation_num) const
+	{
+		std::error_code error;
+		if (checkpoint_path.has_parent_path())
+			std::filesystem::create_directories(checkpoint_path.parent_path(), error);
+
+		std::filesystem::path temporary_path = checkpoint_path;
+		temporary_path += ".tmp";
+		std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+		if (!file) {
+			std::cerr << "Can't write the checkpoint " << checkpoint_path << "\n";
+			return;
+		}
+
+		checkpoint_header header{};
+		std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+		header.version = checkpoint_version;
+		header.sampler = static_cast<uint32_t>(sampler_mode);
+		header.key = checkpoint_key;
+		header.width = width;
+		header.height = height;
+		header.accumulation_num = accumulation_num;
+		header.adaptive = adaptive ? 1 : 0;
+		header.aov_count = static_cast<uint32_t>(aovs.size());
+		header.progress = progress;
+
+		auto write_section = [&](const void* data, size_t size) {
+			file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+		};
+		write_section(&header, sizeof(header));
+		write_section(history->get_data(), width * height * sizeof(float3));
+		write_section(sample_counts.data(), sample_counts.size() * sizeof(uint32_t));
+		write_section(sample_means.data(), sample_means.size() * sizeof(float3));
+		write_section(sample_deviations.data(), sample_deviations.size() * sizeof(float));
+		for (const auto& output: aovs)
+			write_section(output.buffer->get_data(), width * height * sizeof(float3));
+		file.close();
+
+		std::filesystem::rename(temporary_path, checkpoint_path, error);
+		if (!file || error)
+			std::cerr << "Can't write the checkpoint " << checkpoint_path << "\n";
+	}
+
+	// Returns false without a checkpoint file. One saved by another render,
+	// or cut short, is an error rather than a reason to start over, which
+	// would overwrite it
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::load_checkpoint(size_t accumulation_num)
+	{
+		cg::utils::mapped_file file(checkpoint_path);
+		if (!file.is_open())
+			return false;
+
+		checkpoint_header header;
+		if (file.get_size() < sizeof(header))
+			THROW_ERROR("Checkpoint " + checkpoint_path.string() + " is truncated");
+		std::memcpy(&header, file.get_data(), sizeof(header));
+		if (std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 ||
+			header.version != checkpoint_version || header.key != checkpoint_key ||
+			header.sampler != static_cast<uint32_t>(sampler_mode) || header.width != width ||
+			header.height != height || header.accumulation_num != accumulation_num ||
+			header.adaptive != (adaptive ? 1u : 0u) || header.aov_count != aovs.size())
+			THROW_ERROR("Checkpoint " + checkpoint_path.string() + " belongs to another render");
+
+		const size_t pixel_count = width * height;
+		const size_t expected_size = sizeof(header) +
+									 pixel_count * (sizeof(float3) + sizeof(uint32_t)) +
+									 sample_means.size() * (sizeof(float3) + sizeof(float)) +
+									 aovs.size() * pixel_count * sizeof(float3);
+		if (file.get_size() != expected_size)
+			THROW_ERROR("Checkpoint " + checkpoint_path.string() + " is truncated");
+
+		size_t offset = sizeof(header);
+		auto read_section = [&](void* target, size_t size) {
+			std::memcpy(target, file.get_data() + offset, size);
+			offset += size;
+		};
+		read_section(&history->item(0), pixel_count * sizeof(float3));
+		read_section(sample_counts.data(), pixel_count * sizeof(uint32_t));
+		read_section(sample_means.data(), sample_means.size() * sizeof(float3));
+		read_section(sample_deviations.data(), sample_deviations.size() * sizeof(float));
+		for (auto& output: aovs)
+			read_section(&output.buffer->item(0), pixel_count * sizeof(float3));
+		progress = header.progress;
+		return true;
+	}
+
+	// One ray through every pixel center records what the first hit sees,
+	// for the denoiser to find edges with
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::trace_auxiliary(float3 position, float3 direction,
+												   float3 right, float3 up)
+	{
+#pragma omp parallel for schedule(dynamic, 64)
+		for (int pixel_id = 0; pixel_id < static_cast<int>(width * height); pixel_id++) {
+			const size_t x = pixel_id % width;
+			const size_t y = pixel_id / width;
+			const ray primary_ray(position, get_primary_direction(direction, right, up,
+																  float2{0.f, 0.f}, x, y));
+
+			payload best_hit{};
+			best_hit.t = 1000.f;
+			const triangle<VB>* hit_triangle = nullptr;
+			unsigned hit_instance = 0;
+			if (!closest_hit(primary_ray, 0.001f, best_hit, hit_triangle, hit_instance, false)) {
+				normal_buffer->item(pixel_id) = float3{0.f, 0.f, 0.f};
+				albedo_buffer->item(pixel_id) = float3{0.f, 0.f, 0.f};
+				depth_buffer->item(pixel_id) = 0.f;
+				continue;
+			}
+
+			const triangle<VB> world_triangle =
+					acceleration_structure->get_world_triangle(*hit_triangle, hit_instance);
+			normal_buffer->item(pixel_id) = normalize(best_hit.bary.x * world_triangle.na +
+													  best_hit.bary.y * world_triangle.nb +
+													  best_hit.bary.z * world_triangle.nc);
+			albedo_buffer->item(pixel_id) = world_triangle.diffuse;
+			depth_buffer->item(pixel_id) = best_hit.t;
+		}
+	}
+
+	// Every pixel first gets adaptive_min_samples samples, or as many as the
+	// sample budget covers. Each further pass samples only the pixels whose
+	// relative error is above the target, the noisiest first when the
+	// remaining budget can't cover all of them
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::trace_adaptive(float3 position, float3 direction,
+												  float3 right, float3 up, size_t depth,
+												  size_t accumulation_num,
+												  cg::utils::tile_scheduler& scheduler)
+	{
+		const size_t pixel_count = width * height;
+		const uint32_t max_samples = static_cast<uint32_t>(accumulation_num);
+		uint32_t min_samples = std::min(adaptive_min_samples, max_samples);
+		// Taken from the whole budget rather than the remaining one, so a
+		// resumed render splits its passes the same way
+		const uint32_t budget_passes = static_cast<uint32_t>(adaptive_sample_budget);
+		if (adaptive_sample_budget > 0.f && budget_passes < min_samples) {
+			std::cerr << "A sample budget of " << adaptive_sample_budget
+					  << " per pixel can't give every pixel " << min_samples
+					  << " samples, noise estimates will be rough\n";
+			min_samples = budget_passes;
+		}
+		std::vector<float> errors(pixel_count);
+
+		for (uint32_t pass = static_cast<uint32_t>(progress.passes); pass < max_samples; pass++) {
+			if (pass >= min_samples) {
+#pragma omp parallel for
+				for (int pixel_id = 0; pixel_id < static_cast<int>(pixel_count); pixel_id++)
+					errors[pixel_id] = sample_counts[pixel_id] < max_samples
+											   ? get_relative_error(pixel_id)
+											   : -1.f;
+
+				active_pixel_ids.clear();
+				for (unsigned pixel_id = 0; pixel_id < pixel_count; pixel_id++) {
+					if (errors[pixel_id] > adaptive_target_noise)
+						active_pixel_ids.push_back(pixel_id);
+				}
+				if (active_pixel_ids.size() > progress.remaining_samples) {
+					std::nth_element(active_pixel_ids.begin(),
+									 active_pixel_ids.begin() + progress.remaining_samples,
+									 active_pixel_ids.end(),
+									 [&](unsigned a, unsigned b) { return errors[a] > errors[b]; });
+					active_pixel_ids.resize(progress.remaining_samples);
+				}
+
+				std::fill(active_pixels.begin(), active_pixels.end(), 0);
+				for (unsigned pixel_id: active_pixel_ids)
+					active_pixels[pixel_id] = 1;
+			}
+			if (active_pixel_ids.empty())
+				break;
+
+			std::cout << "Tracing pass #" << pass + 1 << ", "
+					  << active_pixel_ids.size() << " pixels\n";
+			trace_pass(position, direction, right, up, depth, scheduler);
+
+			progress.passes = pass + 1;
+			progress.traced_samples += active_pixel_ids.size();
+			progress.remaining_samples -= std::min<uint64_t>(progress.remaining_samples,
+															 active_pixel_ids.size());
+			if (pass + 1 < max_samples && progress.remaining_samples > 0) {
+				update_preview(pass + 1, accumulation_num);
+				update_checkpoint(accumulation_num);
+			}
+		}
+
+		std::cout << "Adaptive sampling: "
+				  << static_cast<float>(progress.traced_samples) / static_cast<float>(pixel_count)
+				  << " samples per pixel on average\n";
+	}
+
+	// Samples every active pixel once, in tiles or as one wavefront
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::trace_pass(float3 position, float3 direction,
+											  float3 right, float3 up, size_t depth,
+											  cg::utils::tile_scheduler& scheduler)
+	{
+		if (integrator == integrator_mode::wavefront) {
+			trace_wavefront(position, direction, right, up, depth);
+
+#pragma omp parallel for
+			for (int path_id = 0; path_id < static_cast<int>(active_pixel_ids.size()); path_id++) {
+				const unsigned pixel_id = active_pixel_ids[path_id];
+				accumulate_sample(pixel_id, frame_radiance[pixel_id]);
+			}
+			return;
+		}
+
+		// Threads claim tiles until none are left, so an expensive corner
+		// of the image no longer leaves the others idle
+		scheduler.reset();
+#pragma omp parallel
+		{
+			const unsigned worker_id = static_cast<unsigned>(omp_get_thread_num());
+			size_t tile_id;
+			while (scheduler.next_tile(worker_id, tile_id)) {
+				auto tile_start = std::chrono::high_resolution_clock::now();
+				trace_tile(scheduler.get_tile(tile_id), position, direction, right, up, depth);
+				auto tile_stop = std::chrono::high_resolution_clock::now();
+				std::chrono::duration<float, std::milli> tile_duration = tile_stop - tile_start;
+				tile_timings[tile_id].milliseconds += tile_duration.count();
+			}
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::trace_tile(const cg::utils::tile_scheduler::tile& tile,
+											  float3 position, float3 direction,
+											  float3 right, float3 up, size_t depth)
+	{
+		for (size_t packet_y = tile.y_begin; packet_y < tile.y_end; packet_y += packet_size) {
+			for (size_t packet_x = tile.x_begin; packet_x < tile.x_end; packet_x += packet_size) {
+				ray rays[max_packet_rays];
+				sampler samplers[max_packet_rays];
+				unsigned ray_count = 0;
+				size_t pixel_ids[max_packet_rays];
+
+				for (size_t y = packet_y; y < std::min(tile.y_end, packet_y + packet_size); y++) {
+					for (size_t x = packet_x; x < std::min(tile.x_end, packet_x + packet_size); x++) {
+						const size_t pixel_id = y * width + x;
+						if (!active_pixels[pixel_id])
+							continue;
+
+						// The first two dimensions of the camera ray jitter it in the pixel
+						sampler pixel_sampler(static_cast<uint32_t>(x), static_cast<uint32_t>(y),
+											  static_cast<uint32_t>(width), sample_counts[pixel_id],
+											  sampler_mode);
+						const float2 jitter = pixel_sampler.next_float2() - 0.5f;
+						pixel_ids[ray_count] = pixel_id;
+						samplers[ray_count] = pixel_sampler;
+						rays[ray_count++] = ray(position, get_primary_direction(direction, right, up,
+																				jitter, x, y));
+					}
+				}
+				if (ray_count == 0)
+					continue;
+
+				payload hit_results[max_packet_rays];
+				trace_packet(rays, samplers, ray_count, hit_results, depth);
+
+				for (unsigned i = 0; i < ray_count; i++)
+					accumulate_sample(pixel_ids[i], hit_results[i].color.to_float3());
+			}
+		}
+	}
+
+	// Uniform sampling sums each sample's share of the linear mean into
+	// history. Adaptive sampling keeps Welford's running mean and the
+	// luminance deviations instead
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::accumulate_sample(size_t pixel_id, float3 color)
+	{
+		const uint32_t count = ++sample_counts[pixel_id];
+		if (!adaptive) {
+			history->item(pixel_id) += color * inv_accum;
+			return;
+		}
+
+		const float3 delta = color - sample_means[pixel_id];
+		sample_means[pixel_id] += delta / static_cast<float>(count);
+		sample_deviations[pixel_id] += luminance(delta) * luminance(color - sample_means[pixel_id]);
+	}
+
+	// Standard error of the pixel mean relative to its luminance
+	template<typename VB, typename RT>
+	inline float raytracer<VB, RT>::get_relative_error(size_t pixel_id) const
+	{
+		const uint32_t count = sample_counts[pixel_id];
+		if (count < 2)
+			return std::numeric_limits<float>::max();
+
+		const float variance = sample_deviations[pixel_id] / static_cast<float>(count - 1);
+		const float standard_error = std::sqrt(variance / static_cast<float>(count));
+		return standard_error / (luminance(sample_means[pixel_id]) + 1e-4f);
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::set_lights(const std::vector<light>& in_lights)
+	{
+		lights = in_lights;
+		emissive_triangles.clear();
+
+		if (acceleration_structure) {
+			const auto& instances = acceleration_structure->get_instances();
+			const auto& bottom_levels = acceleration_structure->get_bottom_levels();
+			for (unsigned instance_id = 0; instance_id < instances.size(); instance_id++) {
+				const bvh<VB>& bottom_level = *bottom_levels[instances[instance_id].bottom_level];
+				const auto& level_triangles = bottom_level.get_triangles();
+				std::vector<triangle_geometry> level_geometry;
+				for (size_t triangle_id = 0; triangle_id < level_triangles.size(); triangle_id++) {
+					if (luminance(level_triangles[triangle_id].emissive) <= 0.f)
+						continue;
+					if (level_geometry.empty())
+						level_geometry = bottom_level.get_triangle_geometry();
+
+					emissive_triangle emitter;
+					emitter.geometry = acceleration_structure->get_world_geometry(
+							level_geometry[triangle_id], instance_id);
+					emitter.emissive = level_triangles[triangle_id].emissive;
+					emitter.area = 0.5f * length(cross(emitter.geometry.ba, emitter.geometry.ca));
+					if (emitter.area > 0.f)
+						emissive_triangles.push_back(emitter);
+				}
+			}
+		}
+
+		light_cdf.clear();
+		float total_power = 0.f;
+		for (const auto& point_light: lights)
+			light_cdf.push_back(total_power += luminance(point_light.color));
+		for (const auto& emitter: emissive_triangles)
+			light_cdf.push_back(total_power += luminance(emitter.emissive) * emitter.area);
+		if (total_power <= 0.f)
+			light_cdf.clear();
+		for (float& probability: light_cdf)
+			probability /= total_power;
+
+		std::cout << "Lights: " << lights.size() << " point, "
+				  << emissive_triangles.size() << " emissive triangles\n";
+	}
+
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::sample_light(float3 position, sampler& random,
+												light_sample& sample) const
+	{
+		if (light_cdf.empty())
+			return false;
+
+		const size_t light_id = std::min(
+				static_cast<size_t>(std::upper_bound(light_cdf.begin(), light_cdf.end(),
+													 random.next_float()) -
+									light_cdf.begin()),
+				light_cdf.size() - 1);
+		const float pick_probability = light_cdf[light_id] - (light_id > 0 ? light_cdf[light_id - 1] : 0.f);
+		if (pick_probability <= 0.f)
+			return false;
+
+		float3 light_position;
+		float3 light_radiance;
+		float area_to_solid_angle = 1.f;
+		if (light_id < lights.size()) {
+			light_position = lights[light_id].position;
+			light_radiance = lights[light_id].color;
+		}
+		else {
+			const emissive_triangle& emitter = emissive_triangles[light_id - lights.size()];
+			const float2 uv = random.next_float2();
+			const float root = std::sqrt(uv.x);
+			light_position = emitter.geometry.a + root * (1.f - uv.y) * emitter.geometry.ba +
+							 root * uv.y * emitter.geometry.ca;
+			light_radiance = emitter.emissive;
+			// Emitters are hit from both sides, so they emit from both sides
+			area_to_solid_angle = std::abs(dot(normalize(cross(emitter.geometry.ba, emitter.geometry.ca)),
+											   normalize(light_position - position))) *
+								  emitter.area;
+		}
+
+		const float3 to_light = light_position - position;
+		const float distance_squared = dot(to_light, to_light);
+		if (distance_squared < 1e-8f || area_to_solid_angle <= 0.f)
+			return false;
+
+		sample.distance = std::sqrt(distance_squared);
+		sample.direction = to_light / sample.distance;
+		sample.radiance = light_radiance * (area_to_solid_angle / (distance_squared * pick_probability));
+		return true;
+	}
+
+	template<typename VB, typename RT>
+	inline float raytracer<VB, RT>::luminance(float3 color)
+	{
+		return dot(color, float3{0.2126f, 0.7152f, 0.0722f});
+	}
+
+	template<typename VB, typename RT>
+	inline const std::vector<tile_timing>& raytracer<VB, RT>::get_tile_timings() const
+	{
+		return tile_timings;
+	}
+
+	template<typename VB, typename RT>
+	inline float3 raytracer<VB, RT>::get_primary_direction(float3 direction, float3 right,
+														   float3 up, float2 jitter,
+														   size_t x, size_t y) const
+	{
+		float u = (2.f * x + jitter.x) / static_cast<float>(width - 1) - 1.f;
+		float v = (2.f * y + jitter.y) / static_cast<float>(height - 1) - 1.f;
+		u *= static_cast<float>(width) / static_cast<float>(height);
+
+		return direction + u * right - v * up;
+	}
+
+	// Wavefront integrator: generates one path per active pixel, then runs the extend,
+	// shade and connect kernels once per bounce over the compacted queue
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::trace_wavefront(float3 position, float3 direction,
+												   float3 right, float3 up,
+												   size_t depth)
+	{
+		const size_t pixel_count = width * height;
+		frame_radiance.assign(pixel_count, float3{0.f, 0.f, 0.f});
+		paths.resize(pixel_count);
+		next_paths.resize(pixel_count);
+		shadow_rays.resize(pixel_count);
+
+		// Generate
+		const int path_count = static_cast<int>(active_pixel_ids.size());
+#pragma omp parallel for
+		for (int path_id = 0; path_id < path_count; path_id++) {
+			const unsigned pixel_id = active_pixel_ids[path_id];
+			const size_t x = pixel_id % width;
+			const size_t y = pixel_id / width;
+			sampler pixel_sampler(static_cast<uint32_t>(x), static_cast<uint32_t>(y),
+								  static_cast<uint32_t>(width), sample_counts[pixel_id], sampler_mode);
+			const float2 jitter = pixel_sampler.next_float2() - 0.5f;
+			paths.rays[path_id] = ray(position, get_primary_direction(direction, right, up, jitter, x, y));
+			paths.throughputs[path_id] = float3{1.f, 1.f, 1.f};
+			paths.pixel_ids[path_id] = pixel_id;
+			paths.samplers[path_id] = pixel_sampler;
+		}
+		paths.size = active_pixel_ids.size();
+
+		for (size_t bounce = 0; bounce < depth && paths.size > 0; bounce++) {
+			extend_paths();
+
+			next_paths.size = 0;
+			shadow_rays.size = 0;
+			shade_paths(bounce, depth);
+			connect_paths();
+
+			std::swap(paths.rays, next_paths.rays);
+			std::swap(paths.throughputs, next_paths.throughputs);
+			std::swap(paths.pixel_ids, next_paths.pixel_ids);
+			std::swap(paths.samplers, next_paths.samplers);
+			paths.size = next_paths.size.load();
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::extend_paths()
+	{
+		const int path_count = static_cast<int>(paths.size);
+
+#pragma omp parallel for schedule(dynamic, 256)
+		for (int path_id = 0; path_id < path_count; path_id++) {
+			payload best_hit{};
+			best_hit.t = 1000.f;
+			const triangle<VB>* hit_triangle = nullptr;
+			unsigned hit_instance = 0;
+
+			if (closest_hit(paths.rays[path_id], 0.001f, best_hit, hit_triangle, hit_instance, false)) {
+				const unsigned bottom_level = acceleration_structure->get_instances()[hit_instance].bottom_level;
+				paths.hit_t[path_id] = best_hit.t;
+				paths.hit_bary[path_id] = best_hit.bary;
+				paths.hit_triangles[path_id] = static_cast<unsigned>(
+						hit_triangle - acceleration_structure->get_bottom_levels()[bottom_level]->get_triangles().data());
+				paths.hit_instances[path_id] = hit_instance;
+			}
+			else {
+				paths.hit_triangles[path_id] = path_queue::no_hit;
+			}
+		}
+	}
+
+	// Adds emitted and escaped radiance, and compacts the surviving paths and
+	// the requested shadow connections into their queues
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::shade_paths(size_t bounce, size_t depth)
+	{
+		const int path_count = static_cast<int>(paths.size);
+
+#pragma omp parallel for schedule(dynamic, 256)
+		for (int path_id = 0; path_id < path_count; path_id++) {
+			const ray& current_ray = paths.rays[path_id];
+			const float3 throughput = paths.throughputs[path_id];
+			const unsigned pixel_id = paths.pixel_ids[path_id];
+
+			if (paths.hit_triangles[path_id] == path_queue::no_hit) {
+				frame_radiance[pixel_id] += throughput * miss_shader(current_ray).color.to_float3();
+				continue;
+			}
+
+			payload hit{};
+			hit.t = paths.hit_t[path_id];
+			hit.bary = paths.hit_bary[path_id];
+			hit.random = paths.samplers[path_id];
+			hit.throughput = throughput;
+			const size_t next_depth = depth - bounce - 1;
+			const unsigned hit_instance = paths.hit_instances[path_id];
+			const unsigned bottom_level = acceleration_structure->get_instances()[hit_instance].bottom_level;
+			const triangle<VB> hit_triangle = acceleration_structure->get_world_triangle(
+					acceleration_structure->get_bottom_levels()[bottom_level]->get_triangles()[paths.hit_triangles[path_id]],
+					hit_instance);
+			scatter_result result = scatter_shader(current_ray, hit, hit_triangle, next_depth);
+
+			frame_radiance[pixel_id] += throughput * result.emitted;
+
+			if (result.connect) {
+				const size_t shadow_id = shadow_rays.size++;
+				shadow_rays.rays[shadow_id] = result.shadow_ray;
+				shadow_rays.max_t[shadow_id] = result.shadow_max_t;
+				shadow_rays.radiance[shadow_id] = throughput * result.shadow_radiance;
+				shadow_rays.pixel_ids[shadow_id] = pixel_id;
+			}
+
+			if (!result.scattered)
+				continue;
+
+			// Mirrors trace_ray, which runs the miss shader once the depth is exhausted
+			if (next_depth == 0) {
+				frame_radiance[pixel_id] += throughput * result.attenuation *
+											miss_shader(result.next_ray).color.to_float3();
+				continue;
+			}
+
+			// Same draw trace_ray makes when the recursive integrator continues a path
+			sampler next_sampler = paths.samplers[path_id].next_bounce();
+			const float3 next_throughput = throughput * result.attenuation;
+			const float survival = roulette(next_sampler, next_throughput);
+			if (survival == 0.f)
+				continue;
+
+			const size_t next_id = next_paths.size++;
+			next_paths.rays[next_id] = result.next_ray;
+			next_paths.throughputs[next_id] = next_throughput / survival;
+			next_paths.pixel_ids[next_id] = pixel_id;
+			next_paths.samplers[next_id] = next_sampler;
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::connect_paths()
+	{
+		const int shadow_count = static_cast<int>(shadow_rays.size);
+
+#pragma omp parallel for schedule(dynamic, 256)
+		for (int shadow_id = 0; shadow_id < shadow_count; shadow_id++) {
+			if (!occluded(shadow_rays.rays[shadow_id], shadow_rays.max_t[shadow_id]))
+				frame_radiance[shadow_rays.pixel_ids[shadow_id]] += shadow_rays.radiance[shadow_id];
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline payload raytracer<VB, RT>::trace_ray(const ray& ray, size_t depth,
+												float max_t, float min_t) const
+	{
+		return trace_ray(ray, depth, sampler{}, max_t, min_t);
+	}
+
+	template<typename VB, typename RT>
+	inline payload raytracer<VB, RT>::trace_ray(const ray& ray, size_t depth,
+												const sampler& path_sampler,
+												float max_t, float min_t) const
+	{
+		return trace_ray(ray, depth, path_sampler, float3{1.f, 1.f, 1.f}, max_t, min_t);
+	}
+
+	template<typename VB, typename RT>
+	inline payload raytracer<VB, RT>::trace_ray(const ray& ray, size_t depth,
+												const sampler& path_sampler,
+												float3 throughput,
+												float max_t, float min_t) const
+	{
+		if (depth == 0)
+			return miss_shader(ray);
+
+		size_t next_depth = depth - 1;
+
+		payload best_hit{};
+		best_hit.t = max_t;
+		best_hit.random = path_sampler;
+		const float survival = roulette(best_hit.random, throughput);
+		if (survival == 0.f) {
+			best_hit.color = cg::color{0.f, 0.f, 0.f};
+			return best_hit;
+		}
+		best_hit.throughput = throughput / survival;
+
+		const triangle<VB>* hit_triangle = nullptr;
+		unsigned hit_instance = 0;
+
+		payload result;
+		if (closest_hit(ray, min_t, best_hit, hit_triangle, hit_instance, any_hit_shader != nullptr)) {
+			const triangle<VB> world_triangle =
+					acceleration_structure->get_world_triangle(*hit_triangle, hit_instance);
+			if (any_hit_shader)
+				result = any_hit_shader(ray, best_hit, world_triangle);
+			else if (closest_hit_shader)
+				result = closest_hit_shader(ray, best_hit, world_triangle, next_depth);
+			else
+				result = miss_shader(ray);
+		}
+		else {
+			result = miss_shader(ray);
+		}
+
+		// Survivors stand in for the paths roulette ended
+		if (survival < 1.f)
+			result.color = cg::color::from_float3(result.color.to_float3() / survival);
+		return result;
+	}
+
+	// Russian roulette: a path survives with a probability that follows its
+	// throughput, and the survivors are weighted up by its inverse, so the
+	// estimate stays unbiased while dim paths stop early
+	template<typename VB, typename RT>
+	inline float raytracer<VB, RT>::roulette(sampler& random, float3 throughput) const
+	{
+		if (roulette_depth == 0 || random.get_bounce() < roulette_depth)
+			return 1.f;
+
+		const float survival = std::min(maxelem(throughput), max_survival_probability);
+		if (random.next_float() >= survival)
+			return 0.f;
+		return survival;
+	}
+
+	// Walks the top-level tree and each instance it reaches with the ray moved
+	// into the instance's object space. hit_triangle points into the bottom
+	// level of hit_instance, in object space.
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::closest_hit(const ray& ray, float min_t,
+											   payload& best_hit,
+											   const triangle<VB>*& hit_triangle,
+											   unsigned& hit_instance,
+											   bool stop_at_first_hit) const
+	{
+		if (!acceleration_structure)
+			return false;
+
+		const auto& instances = acceleration_structure->get_instances();
+		const auto& bottom_levels = acceleration_structure->get_bottom_levels();
+		if (acceleration_structure->is_single_level()) {
+			hit_instance = 0;
+			return closest_hit(*bottom_levels[instances[0].bottom_level], ray, min_t, best_hit,
+							   hit_triangle, stop_at_first_hit);
+		}
+
+		const auto& nodes = acceleration_structure->get_tree().get_wide_nodes();
+		const auto& leaf_instances = acceleration_structure->get_leaf_instances();
+		if (nodes.empty())
+			return false;
+
+		traversal_entry stack[bvh<VB>::max_depth * wide_bvh_width];
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, 0, min_t};
+		bool found = false;
+
+		while (stack_size > 0) {
+			const traversal_entry entry = stack[--stack_size];
+			if (entry.t >= best_hit.t)
+				continue;
+
+			if (entry.triangle_count > 0) {
+				for (unsigned i = 0; i < entry.triangle_count; i++) {
+					const unsigned instance_id = leaf_instances[entry.index + i];
+					const instance& placement = instances[instance_id];
+					const cg::renderer::ray object_ray =
+							placement.identity ? ray : placement.to_object_space(ray);
+					if (!closest_hit(*bottom_levels[placement.bottom_level], object_ray, min_t,
+									 best_hit, hit_triangle, stop_at_first_hit))
+						continue;
+
+					hit_instance = instance_id;
+					found = true;
+					if (stop_at_first_hit)
+						return true;
+				}
+				continue;
+			}
+
+			const wide_bvh_node& node = nodes[entry.index];
+			alignas(32) float t_near[wide_bvh_width];
+			unsigned hit_mask = node.intersect(ray, min_t, best_hit.t, t_near);
+			push_hit_children(node, hit_mask, t_near, stack, stack_size);
+		}
+
+		return found;
+	}
+
+	// Narrows best_hit down to the closest triangle in the subtree. Returns
+	// whether any triangle was hit; with stop_at_first_hit the walk ends there.
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::closest_hit(const bvh<VB>& bottom_level,
+											   const ray& ray, float min_t,
+											   payload& best_hit,
+											   const triangle<VB>*& hit_triangle,
+											   bool stop_at_first_hit,
+											   traversal_entry root) const
+	{
+		const auto& nodes = bottom_level.get_wide_nodes();
+		const auto& blocks = bottom_level.get_triangle_blocks();
+		const auto& triangles = bottom_level.get_triangles();
+		if (nodes.empty())
+			return false;
+
+		traversal_entry stack[bvh<VB>::max_depth * wide_bvh_width];
+		size_t stack_size = 0;
+		stack[stack_size++] = {root.index, root.triangle_count, min_t};
+		bool found = false;
+
+		while (stack_size > 0) {
+			const traversal_entry entry = stack[--stack_size];
+			// The subtree was pushed before a closer hit was found
+			if (entry.t >= best_hit.t)
+				continue;
+
+			if (entry.triangle_count > 0) {
+				const unsigned block_count = (entry.triangle_count + triangle_block_width - 1) / triangle_block_width;
+				for (unsigned i = 0; i < block_count; i++) {
+					float t, u, v;
+					int lane = blocks[entry.index + i].intersect(ray, min_t, best_hit.t, t, u, v);
+					if (lane < 0)
+						continue;
+					assert(block_hit_matches(blocks[entry.index + i], ray, min_t, best_hit.t, lane, t, u, v));
+
+					best_hit.t = t;
+					best_hit.bary = float3{1.f - u - v, u, v};
+					hit_triangle = &triangles[blocks[entry.index + i].triangle_ids[lane]];
+					found = true;
+
+					if (stop_at_first_hit)
+						return true;
+				}
+				continue;
+			}
+
+			const wide_bvh_node& node = nodes[entry.index];
+			alignas(32) float t_near[wide_bvh_width];
+			unsigned hit_mask = node.intersect(ray, min_t, best_hit.t, t_near);
+			push_hit_children(node, hit_mask, t_near, stack, stack_size);
+		}
+
+		return found;
+	}
+
+	// Pushes the hit children far to near, so the nearest one is popped first
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::push_hit_children(const wide_bvh_node& node,
+													 unsigned hit_mask, const float* t_near,
+													 traversal_entry* stack, size_t& stack_size)
+	{
+		traversal_entry hit_children[wide_bvh_width];
+		unsigned hit_count = 0;
+		for (unsigned i = 0; i < wide_bvh_width; i++) {
+			if (!(hit_mask & (1u << i)))
+				continue;
+			traversal_entry child{node.children[i], node.triangle_counts[i], t_near[i]};
+			unsigned position = hit_count++;
+			while (position > 0 && hit_children[position - 1].t < child.t) {
+				hit_children[position] = hit_children[position - 1];
+				position--;
+			}
+			hit_children[position] = child;
+		}
+		for (unsigned i = 0; i < hit_count; i++)
+			stack[stack_size++] = hit_children[i];
+	}
+
+	// Cross-checks a result of the SIMD block kernel against the scalar
+	// intersection shader: the same lane must be the nearest one, at the same
+	// t and barycentrics, and a miss (lane -1) must have no lane hit at all.
+	// Hits close to an edge or to the ends of the ray interval are left out,
+	// as the two kernels may round them differently.
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::block_hit_matches(const triangle_block& block, const ray& ray,
+													 float min_t, float max_t, int lane,
+													 float t, float u, float v) const
+	{
+		if (lane < 0)
+			t = max_t;
+		constexpr float tolerance = 1e-3f;
+		for (unsigned i = 0; i < triangle_block_width; i++) {
+			const payload reference = intersection_shader(block.get_triangle(i), ray);
+			const float t_tolerance = tolerance * std::max(1.f, std::abs(reference.t));
+			const bool interior = minelem(reference.bary) > tolerance &&
+								  reference.t > min_t + t_tolerance && reference.t < max_t - t_tolerance;
+			if (static_cast<int>(i) != lane) {
+				if (interior && reference.t < t - t_tolerance)
+					return false;
+				continue;
+			}
+			if (!interior)
+				continue;
+			if (std::abs(reference.t - t) > t_tolerance ||
+				std::abs(reference.bary.y - u) > tolerance ||
+				std::abs(reference.bary.z - v) > tolerance)
+				return false;
+		}
+		return true;
+	}
+
+	// Visibility query for shadow rays: stops at the first blocker and does
+	// not order children or compute barycentrics
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::occluded(const ray& ray, float max_t, float min_t) const
+	{
+		if (!acceleration_structure)
+			return false;
+
+		const auto& instances = acceleration_structure->get_instances();
+		const auto& bottom_levels = acceleration_structure->get_bottom_levels();
+		if (acceleration_structure->is_single_level())
+			return occluded(*bottom_levels[instances[0].bottom_level], ray, max_t, min_t);
+
+		const auto& nodes = acceleration_structure->get_tree().get_wide_nodes();
+		const auto& leaf_instances = acceleration_structure->get_leaf_instances();
+		if (nodes.empty())
+			return false;
+
+		traversal_entry stack[bvh<VB>::max_depth * wide_bvh_width];
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, 0, min_t};
+
+		while (stack_size > 0) {
+			const traversal_entry entry = stack[--stack_size];
+
+			if (entry.triangle_count > 0) {
+				for (unsigned i = 0; i < entry.triangle_count; i++) {
+					const instance& placement = instances[leaf_instances[entry.index + i]];
+					const cg::renderer::ray object_ray =
+							placement.identity ? ray : placement.to_object_space(ray);
+					if (occluded(*bottom_levels[placement.bottom_level], object_ray, max_t, min_t))
+						return true;
+				}
+				continue;
+			}
+
+			const wide_bvh_node& node = nodes[entry.index];
+			alignas(32) float t_near[wide_bvh_width];
+			unsigned hit_mask = node.intersect(ray, min_t, max_t, t_near);
+			for (unsigned i = 0; i < wide_bvh_width; i++) {
+				if (hit_mask & (1u << i))
+					stack[stack_size++] = {node.children[i], node.triangle_counts[i], t_near[i]};
+			}
+		}
+
+		return false;
+	}
+
+	template<typename VB, typename RT>
+	inline bool raytracer<VB, RT>::occluded(const bvh<VB>& bottom_level, const ray& ray,
+											float max_t, float min_t) const
+	{
+		const auto& nodes = bottom_level.get_wide_nodes();
+		const auto& blocks = bottom_level.get_triangle_blocks();
+		if (nodes.empty())
+			return false;
+
+		traversal_entry stack[bvh<VB>::max_depth * wide_bvh_width];
+		size_t stack_size = 0;
+		stack[stack_size++] = {0, 0, min_t};
+
+		while (stack_size > 0) {
+			const traversal_entry entry = stack[--stack_size];
+
+			if (entry.triangle_count > 0) {
+				const unsigned block_count = (entry.triangle_count + triangle_block_width - 1) / triangle_block_width;
+				for (unsigned i = 0; i < block_count; i++) {
+					if (blocks[entry.index + i].occluded(ray, min_t, max_t))
+						return true;
+				}
+				continue;
+			}
+
+			const wide_bvh_node& node = nodes[entry.index];
+			alignas(32) float t_near[wide_bvh_width];
+			unsigned hit_mask = node.intersect(ray, min_t, max_t, t_near);
+			for (unsigned i = 0; i < wide_bvh_width; i++) {
+				if (hit_mask & (1u << i))
+					stack[stack_size++] = {node.children[i], node.triangle_counts[i], t_near[i]};
+			}
+		}
+
+		return false;
+	}
+
+	// Traces coherent rays together: each node is fetched once for the whole
+	// packet and every stack entry carries the mask of rays still inside it
+	template<typename VB, typename RT>
+	inline void raytracer<VB, RT>::trace_packet(const ray* rays, const sampler* samplers,
+												unsigned ray_count, payload* results,
+												size_t depth, float max_t, float min_t) const
+	{
+		// Instanced scenes would need the packet moved into every instance's object space
+		bool coherent = depth > 0 && !any_hit_shader && ray_count <= max_packet_rays &&
+						acceleration_structure && acceleration_structure->is_single_level();
+		// Rays heading into different octants share little of the traversal
+		for (unsigned i = 1; coherent && i < ray_count; i++) {
+			coherent = (rays[i].direction.x < 0.f) == (rays[0].direction.x < 0.f) &&
+					   (rays[i].direction.y < 0.f) == (rays[0].direction.y < 0.f) &&
+					   (rays[i].direction.z < 0.f) == (rays[0].direction.z < 0.f);
+		}
+		if (!coherent) {
+			for (unsigned i = 0; i < ray_count; i++)
+				results[i] = trace_ray(rays[i], depth, samplers[i], max_t, min_t);
+			return;
+		}
+
+		const bvh<VB>& bottom_level = *acceleration_structure->get_bottom_levels()[
+				acceleration_structure->get_instances()[0].bottom_level];
+		const auto& nodes = bottom_level.get_wide_nodes();
+		const auto& blocks = bottom_level.get_triangle_blocks();
+		const auto& triangles = bottom_level.get_triangles();
+		if (nodes.empty()) {
+			for (unsigned i = 0; i < ray_count; i++)
+				results[i] = miss_shader(rays[i]);
+			return;
+		}
+
+		payload best_hits[max_packet_rays];
+		const triangle<VB>* hit_triangles[max_packet_rays];
+		for (unsigned i = 0; i < ray_count; i++) {
+			best_hits[i] = payload{};
+			best_hits[i].t = max_t;
+			best_hits[i].random = samplers[i];
+			hit_triangles[i] = nullptr;
+		}
+
+		struct packet_entry
+		{
+			traversal_entry subtree;
+			uint32_t ray_mask;
+		};
+		packet_entry stack[bvh<VB>::max_depth * wide_bvh_width];
+		size_t stack_size = 0;
+		const uint32_t all_rays = ray_count == 32 ? ~uint32_t{0} : (uint32_t{1} << ray_count) - 1;
+		stack[stack_size++] = {{0, 0, min_t}, all_rays};
+
+		while (stack_size > 0) {
+			const packet_entry entry = stack[--stack_size];
+
+			uint32_t ray_mask = 0;
+			for (unsigned i = 0; i < ray_count; i++) {
+				if ((entry.ray_mask & (1u << i)) && entry.subtree.t < best_hits[i].t)
+					ray_mask |= 1u << i;
+			}
+			if (ray_mask == 0)
+				continue;
+
+			const unsigned active_count = static_cast<unsigned>(std::bitset<32>(ray_mask).count());
+			if (active_count <= packet_divergence_threshold) {
+				for (unsigned i = 0; i < ray_count; i++) {
+					if (ray_mask & (1u << i))
+						closest_hit(bottom_level, rays[i], min_t, best_hits[i], hit_triangles[i], false,
+									entry.subtree);
+				}
+				continue;
+			}
+
+			if (entry.subtree.triangle_count > 0) {
+				const unsigned block_count = (entry.subtree.triangle_count + triangle_block_width - 1) / triangle_block_width;
+				for (unsigned i = 0; i < ray_count; i++) {
+					if (!(ray_mask & (1u << i)))
+						continue;
+					for (unsigned block_id = 0; block_id < block_count; block_id++) {
+						const triangle_block& block = blocks[entry.subtree.index + block_id];
+						float t, u, v;
+						int lane = block.intersect(rays[i], min_t, best_hits[i].t, t, u, v);
+						if (lane < 0)
+							continue;
+						assert(block_hit_matches(block, rays[i], min_t, best_hits[i].t, lane, t, u, v));
+
+						best_hits[i].t = t;
+						best_hits[i].bary = float3{1.f - u - v, u, v};
+						hit_triangles[i] = &triangles[block.triangle_ids[lane]];
+					}
+				}
+				continue;
+			}
+
+			const wide_bvh_node& node = nodes[entry.subtree.index];
+			uint32_t child_masks[wide_bvh_width] = {};
+			float child_t[wide_bvh_width];
+			std::fill(child_t, child_t + wide_bvh_width, std::numeric_limits<float>::max());
+
+			for (unsigned i = 0; i < ray_count; i++) {
+				if (!(ray_mask & (1u << i)))
+					continue;
+				alignas(32) float t_near[wide_bvh_width];
+				unsigned hit_mask = node.intersect(rays[i], min_t, best_hits[i].t, t_near);
+				for (unsigned child = 0; child < wide_bvh_width; child++) {
+					if (hit_mask & (1u << child)) {
+						child_masks[child] |= 1u << i;
+						child_t[child] = std::min(child_t[child], t_near[child]);
+					}
+				}
+			}
+
+			// Same far to near order as for single rays, by the nearest entry in the packet
+			packet_entry hit_children[wide_bvh_width];
+			unsigned hit_count = 0;
+			for (unsigned child = 0; child < wide_bvh_width; child++) {
+				if (child_masks[child] == 0)
+					continue;
+				packet_entry child_entry{{node.children[child], node.triangle_counts[child], child_t[child]},
+										 child_masks[child]};
+				unsigned position = hit_count++;
+				while (position > 0 && hit_children[position - 1].subtree.t < child_entry.subtree.t) {
+					hit_children[position] = hit_children[position - 1];
+					position--;
+				}
+				hit_children[position] = child_entry;
+			}
+			for (unsigned i = 0; i < hit_count; i++)
+				stack[stack_size++] = hit_children[i];
+		}
+
+		for (unsigned i = 0; i < ray_count; i++) {
+			if (hit_triangles[i] && closest_hit_shader)
+				results[i] = closest_hit_shader(rays[i], best_hits[i], *hit_triangles[i], depth - 1);
+			else
+				results[i] = miss_shader(rays[i]);
+		}
+	}
+
+	template<typename VB, typename RT>
+	inline payload
+	raytracer<VB, RT>::intersection_shader(const triangle_geometry& geometry,
+										   const ray& ray) const
+	{
+		payload result{};
+		result.t = -1.f;
+
+		float3 edge1 = geometry.ba;
+		float3 edge2 = geometry.ca;
+		float3 h = cross(ray.direction, edge2);
+
+		float determinant = dot(edge1, h);
+		if (determinant > -1e-8 && determinant < 1e-8)
+			return result;
+
+		float inv_determinant = 1.f / determinant;
+		float3 s = ray.position - geometry.a;
+
+		float u_coord = dot(s, h) * inv_determinant;
+		if (u_coord < 0.f || u_coord > 1.f)
+			return result;
+
+		float3 q = cross(s, edge1);
+		float v_coord = dot(ray.direction, q) * inv_determinant;
+		if (v_coord < 0.f || u_coord + v_coord > 1.f)
+			return result;
+
+		result.t = dot(edge2, q) * inv_determinant;
+		result.bary = float3{1.f - u_coord - v_coord, u_coord, v_coord};
+
+		return result;
+	}
+
+	inline void aabb::add_point(const float3& point)
+	{
+		aabb_min = min(aabb_min, point);
+		aabb_max = max(aabb_max, point);
+	}
+
+	inline void aabb::add_aabb(const aabb& other)
+	{
+		aabb_min = min(aabb_min, other.aabb_min);
+		aabb_max = max(aabb_max, other.aabb_max);
+	}
+
+	inline void aabb::clip(const aabb& other)
+	{
+		aabb_min = max(aabb_min, other.aabb_min);
+		aabb_max = min(aabb_max, other.aabb_max);
+	}
+
+	inline float aabb::surface_area() const
+	{
+		if (is_empty())
+			return 0.f;
+		float3 extent = aabb_max - aabb_min;
+		return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+
+	inline bool aabb::is_empty() const
+	{
+		return aabb_min.x > aabb_max.x || aabb_min.y > aabb_max.y || aabb_min.z > aabb_max.z;
+	}
+
+	// Returns the distance to the entry point or float max on a miss
+	inline float aabb::aabb_test(const ray& ray, float min_t, float max_t) const
+	{
+		float3 t_far = (aabb_max - ray.position) * ray.inv_direction;
+		float3 t_near = (aabb_min - ray.position) * ray.inv_direction;
+		float t_enter = std::max(maxelem(min(t_near, t_far)), min_t);
+		float t_exit = std::min(minelem(max(t_near, t_far)), max_t);
+		if (t_enter > t_exit)
+			return std::numeric_limits<float>::max();
+		return t_enter;
+	}
+
+	// Returns a bit mask of the children hit within [min_t, max_t] and
+	// writes their entry distances to t_near
+	inline unsigned wide_bvh_node::intersect(const ray& ray, float min_t, float max_t,
+											 float* t_near) const
+	{
+		const unsigned valid_mask = (1u << child_count) - 1;
+#if defined(CG_SIMD_AVX) || defined(CG_SIMD_SSE)
+		const simd_float origin_x = simd_set(ray.position.x);
+		const simd_float origin_y = simd_set(ray.position.y);
+		const simd_float origin_z = simd_set(ray.position.z);
+		const simd_float inv_x = simd_set(ray.inv_direction.x);
+		const simd_float inv_y = simd_set(ray.inv_direction.y);
+		const simd_float inv_z = simd_set(ray.inv_direction.z);
+
+		const simd_float t0_x = simd_mul(simd_sub(simd_load(min_x), origin_x), inv_x);
+		const simd_float t1_x = simd_mul(simd_sub(simd_load(max_x), origin_x), inv_x);
+		const simd_float t0_y = simd_mul(simd_sub(simd_load(min_y), origin_y), inv_y);
+		const simd_float t1_y = simd_mul(simd_sub(simd_load(max_y), origin_y), inv_y);
+		const simd_float t0_z = simd_mul(simd_sub(simd_load(min_z), origin_z), inv_z);
+		const simd_float t1_z = simd_mul(simd_sub(simd_load(max_z), origin_z), inv_z);
+
+		simd_float t_enter = simd_max(simd_min(t0_x, t1_x), simd_min(t0_y, t1_y));
+		t_enter = simd_max(t_enter, simd_max(simd_min(t0_z, t1_z), simd_set(min_t)));
+		simd_float t_exit = simd_min(simd_max(t0_x, t1_x), simd_max(t0_y, t1_y));
+		t_exit = simd_min(t_exit, simd_min(simd_max(t0_z, t1_z), simd_set(max_t)));
+
+		simd_store(t_near, t_enter);
+		return simd_mask(simd_less_equal(t_enter, t_exit)) & valid_mask;
+#else
+		unsigned mask = 0;
+		for (unsigned i = 0; i < child_count; i++) {
+			aabb child{float3{min_x[i], min_y[i], min_z[i]}, float3{max_x[i], max_y[i], max_z[i]}};
+			t_near[i] = child.aabb_test(ray, min_t, max_t);
+			if (t_near[i] != std::numeric_limits<float>::max())
+				mask |= 1u << i;
+		}
+		return mask & valid_mask;
+#endif
+	}
+
+	// Returns the lane of the nearest hit within (min_t, max_t) or -1
+	inline int triangle_block::intersect(const ray& ray, float min_t, float max_t,
+										 float& t, float& u, float& v) const
+	{
+		alignas(32) float lane_t[triangle_block_width];
+		alignas(32) float lane_u[triangle_block_width];
+		alignas(32) float lane_v[triangle_block_width];
+		const unsigned hit_mask = intersect_lanes(ray, min_t, max_t, lane_t, lane_u, lane_v);
+		if (hit_mask == 0)
+			return -1;
+
+		int nearest = -1;
+		t = max_t;
+		for (unsigned lane = 0; lane < triangle_block_width; lane++) {
+			if ((hit_mask & (1u << lane)) && lane_t[lane] < t) {
+				t = lane_t[lane];
+				nearest = static_cast<int>(lane);
+			}
+		}
+		u = lane_u[nearest];
+		v = lane_v[nearest];
+		return nearest;
+	}
+
+	inline bool triangle_block::occluded(const ray& ray, float min_t, float max_t) const
+	{
+		return intersect_lanes(ray, min_t, max_t, nullptr, nullptr, nullptr) != 0;
+	}
+
+	// Moller-Trumbore over the whole block, returns the mask of lanes hit within
+	// (min_t, max_t). Per lane t and barycentrics are only stored when requested.
+	inline unsigned triangle_block::intersect_lanes(const ray& ray, float min_t, float max_t,
+													float* lane_t, float* lane_u,
+													float* lane_v) const
+	{
+		unsigned hit_mask = 0;
+
+#if defined(CG_SIMD_AVX) || defined(CG_SIMD_SSE)
+		const simd_float direction_x = simd_set(ray.direction.x);
+		const simd_float direction_y = simd_set(ray.direction.y);
+		const simd_float direction_z = simd_set(ray.direction.z);
+		const simd_float ba_x_lanes = simd_load(ba_x);
+		const simd_float ba_y_lanes = simd_load(ba_y);
+		const simd_float ba_z_lanes = simd_load(ba_z);
+		const simd_float ca_x_lanes = simd_load(ca_x);
+		const simd_float ca_y_lanes = simd_load(ca_y);
+		const simd_float ca_z_lanes = simd_load(ca_z);
+
+		const simd_float h_x = simd_sub(simd_mul(direction_y, ca_z_lanes), simd_mul(direction_z, ca_y_lanes));
+		const simd_float h_y = simd_sub(simd_mul(direction_z, ca_x_lanes), simd_mul(direction_x, ca_z_lanes));
+		const simd_float h_z = simd_sub(simd_mul(direction_x, ca_y_lanes), simd_mul(direction_y, ca_x_lanes));
+		const simd_float determinant = simd_add(simd_add(simd_mul(ba_x_lanes, h_x), simd_mul(ba_y_lanes, h_y)),
+												simd_mul(ba_z_lanes, h_z));
+		const simd_float inv_determinant = simd_div(simd_set(1.f), determinant);
+
+		const simd_float s_x = simd_sub(simd_set(ray.position.x), simd_load(a_x));
+		const simd_float s_y = simd_sub(simd_set(ray.position.y), simd_load(a_y));
+		const simd_float s_z = simd_sub(simd_set(ray.position.z), simd_load(a_z));
+		const simd_float u_lanes = simd_mul(simd_add(simd_add(simd_mul(s_x, h_x), simd_mul(s_y, h_y)), simd_mul(s_z, h_z)),
+											inv_determinant);
+
+		const simd_float q_x = simd_sub(simd_mul(s_y, ba_z_lanes), simd_mul(s_z, ba_y_lanes));
+		const simd_float q_y = simd_sub(simd_mul(s_z, ba_x_lanes), simd_mul(s_x, ba_z_lanes));
+		const simd_float q_z = simd_sub(simd_mul(s_x, ba_y_lanes), simd_mul(s_y, ba_x_lanes));
+		const simd_float v_lanes = simd_mul(simd_add(simd_add(simd_mul(direction_x, q_x), simd_mul(direction_y, q_y)),
+													 simd_mul(direction_z, q_z)),
+											inv_determinant);
+		const simd_float t_lanes = simd_mul(simd_add(simd_add(simd_mul(ca_x_lanes, q_x), simd_mul(ca_y_lanes, q_y)),
+													 simd_mul(ca_z_lanes, q_z)),
+											inv_determinant);
+
+		const simd_float zero = simd_set(0.f);
+		const simd_float one = simd_set(1.f);
+		const simd_float abs_determinant = simd_max(determinant, simd_sub(zero, determinant));
+		simd_float hit = simd_less_equal(simd_set(1e-8f), abs_determinant);
+		hit = simd_and(hit, simd_less_equal(zero, u_lanes));
+		hit = simd_and(hit, simd_less_equal(u_lanes, one));
+		hit = simd_and(hit, simd_less_equal(zero, v_lanes));
+		hit = simd_and(hit, simd_less_equal(simd_add(u_lanes, v_lanes), one));
+		hit = simd_and(hit, simd_less(simd_set(min_t), t_lanes));
+		hit = simd_and(hit, simd_less(t_lanes, simd_set(max_t)));
+
+		hit_mask = simd_mask(hit);
+		if (hit_mask != 0 && lane_t) {
+			simd_store(lane_t, t_lanes);
+			simd_store(lane_u, u_lanes);
+			simd_store(lane_v, v_lanes);
+		}
+#else
+		for (unsigned lane = 0; lane < triangle_block_width; lane++) {
+			float3 edge1{ba_x[lane], ba_y[lane], ba_z[lane]};
+			float3 edge2{ca_x[lane], ca_y[lane], ca_z[lane]};
+			float3 h = cross(ray.direction, edge2);
+
+			float determinant = dot(edge1, h);
+			if (determinant > -1e-8f && determinant < 1e-8f)
+				continue;
+
+			float inv_determinant = 1.f / determinant;
+			float3 s = ray.position - float3{a_x[lane], a_y[lane], a_z[lane]};
+			float u = dot(s, h) * inv_determinant;
+			if (u < 0.f || u > 1.f)
+				continue;
+
+			float3 q = cross(s, edge1);
+			float v = dot(ray.direction, q) * inv_determinant;
+			if (v < 0.f || u + v > 1.f)
+				continue;
+
+			float t = dot(edge2, q) * inv_determinant;
+			if (t <= min_t || t >= max_t)
+				continue;
+
+			hit_mask |= 1u << lane;
+			if (lane_t) {
+				lane_t[lane] = t;
+				lane_u[lane] = u;
+				lane_v[lane] = v;
+			}
+		}
+#endif
+
+		return hit_mask;
+	}
+
+	inline void triangle_block::set_triangle(unsigned lane, const triangle_geometry& source,
+											 unsigned triangle_id)
+	{
+		a_x[lane] = source.a.x;
+		a_y[lane] = source.a.y;
+		a_z[lane] = source.a.z;
+		ba_x[lane] = source.ba.x;
+		ba_y[lane] = source.ba.y;
+		ba_z[lane] = source.ba.z;
+		ca_x[lane] = source.ca.x;
+		ca_y[lane] = source.ca.y;
+		ca_z[lane] = source.ca.z;
+		triangle_ids[lane] = triangle_id;
+	}
+
+	inline triangle_geometry triangle_block::get_triangle(unsigned lane) const
+	{
+		triangle_geometry result;
+		result.a = float3{a_x[lane], a_y[lane], a_z[lane]};
+		result.ba = float3{ba_x[lane], ba_y[lane], ba_z[lane]};
+		result.ca = float3{ca_x[lane], ca_y[lane], ca_z[lane]};
+		return result;
+	}
+
+	inline void path_queue::resize(size_t capacity)
+	{
+		rays.resize(capacity);
+		throughputs.resize(capacity);
+		pixel_ids.resize(capacity);
+		samplers.resize(capacity);
+		hit_t.resize(capacity);
+		hit_bary.resize(capacity);
+		hit_triangles.resize(capacity);
+		hit_instances.resize(capacity);
+	}
+
+	inline void shadow_queue::resize(size_t capacity)
+	{
+		rays.resize(capacity);
+		max_t.resize(capacity);
+		radiance.resize(capacity);
+		pixel_ids.resize(capacity);
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::build(std::vector<triangle_geometry> in_geometry,
+							   std::vector<triangle<VB>> in_triangles,
+							   bvh_build_mode mode)
+	{
+		geometry = std::move(in_geometry);
+		triangles = std::move(in_triangles);
+		nodes.clear();
+		wide_nodes.clear();
+		triangle_blocks.clear();
+		triangle_indices.clear();
+		source_triangles.clear();
+		update_views();
+		build_sah_cost = 0.f;
+		if (triangles.empty())
+			return;
+
+		const int triangle_count = static_cast<int>(triangles.size());
+		triangle_indices.resize(triangle_count);
+		triangle_bounds.resize(triangle_count);
+		centroids.resize(triangle_count);
+
+#pragma omp parallel for
+		for (int i = 0; i < triangle_count; i++) {
+			triangle_bounds[i] = get_bounds(geometry[i]);
+			centroids[i] = (triangle_bounds[i].aabb_min + triangle_bounds[i].aabb_max) * 0.5f;
+			triangle_indices[i] = i;
+		}
+
+		build_tree(triangle_count, mode);
+
+		// Triangles are stored in the order the leaves first reference them.
+		// Only spatial splits reference a triangle from several leaves.
+		const unsigned unordered = std::numeric_limits<unsigned>::max();
+		std::vector<unsigned> ordered_ids(triangle_count, unordered);
+		std::vector<unsigned> triangle_order;
+		triangle_order.reserve(triangle_count);
+		for (unsigned& index: triangle_indices) {
+			if (ordered_ids[index] == unordered) {
+				ordered_ids[index] = static_cast<unsigned>(triangle_order.size());
+				triangle_order.push_back(index);
+			}
+			index = ordered_ids[index];
+		}
+
+		std::vector<triangle_geometry> ordered_geometry(triangle_count);
+		std::vector<triangle<VB>> ordered_triangles(triangle_count);
+#pragma omp parallel for
+		for (int i = 0; i < triangle_count; i++) {
+			ordered_geometry[i] = geometry[triangle_order[i]];
+			ordered_triangles[i] = triangles[triangle_order[i]];
+		}
+		geometry = std::move(ordered_geometry);
+		triangles = std::move(ordered_triangles);
+		source_triangles = std::move(triangle_order);
+
+		// From here on positions live only in the triangle blocks
+		collapse();
+		geometry = {};
+		update_views();
+		build_sah_cost = get_sah_cost();
+
+		triangle_bounds = {};
+		centroids = {};
+		morton_codes = {};
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::build(const std::vector<aabb>& in_bounds)
+	{
+		geometry.clear();
+		triangles.clear();
+		nodes.clear();
+		wide_nodes.clear();
+		triangle_blocks.clear();
+		triangle_indices.clear();
+		source_triangles.clear();
+		update_views();
+		if (in_bounds.empty())
+			return;
+
+		const int primitive_count = static_cast<int>(in_bounds.size());
+		triangle_indices.resize(primitive_count);
+		triangle_bounds = in_bounds;
+		centroids.resize(primitive_count);
+		for (int i = 0; i < primitive_count; i++) {
+			centroids[i] = (in_bounds[i].aabb_min + in_bounds[i].aabb_max) * 0.5f;
+			triangle_indices[i] = i;
+		}
+
+		build_tree(primitive_count, bvh_build_mode::sah);
+		collapse();
+		update_views();
+
+		triangle_bounds = {};
+		centroids = {};
+	}
+
+	// Builds the binary nodes over triangle_bounds and centroids, leaving the
+	// leaf order in triangle_indices
+	template<typename VB>
+	inline void bvh<VB>::build_tree(size_t primitive_count, bvh_build_mode mode)
+	{
+		// A binary tree over N leaves never has more than 2N - 1 nodes, so
+		// the storage is allocated once and nodes are claimed atomically.
+		// Spatial splits stop before the references outgrow their budget.
+		reference_limit = primitive_count;
+		if (mode == bvh_build_mode::sbvh)
+			reference_limit += static_cast<size_t>(static_cast<float>(primitive_count) * spatial_split_budget);
+		nodes.resize(2 * reference_limit - 1);
+		node_count = 1;
+
+		bvh_node& root = nodes[0];
+		root.left_first = 0;
+		root.triangle_count = static_cast<unsigned>(primitive_count);
+		aabb centroid_bounds;
+		for (size_t i = 0; i < primitive_count; i++) {
+			root.bounds.add_aabb(triangle_bounds[i]);
+			centroid_bounds.add_point(centroids[i]);
+		}
+
+		if (mode == bvh_build_mode::lbvh) {
+			sort_by_morton_codes(centroid_bounds);
+#pragma omp parallel
+#pragma omp single
+			emit_lbvh(0, 1);
+		}
+		else if (mode == bvh_build_mode::sbvh) {
+			std::vector<reference> references(primitive_count);
+			for (size_t i = 0; i < primitive_count; i++)
+				references[i] = {triangle_bounds[i], static_cast<unsigned>(i)};
+			reference_count = primitive_count;
+			root_area = root.bounds.surface_area();
+
+			// Leaves append their references, duplicates included
+			triangle_indices.clear();
+			triangle_indices.reserve(reference_limit);
+			subdivide_spatial(0, std::move(references), 1);
+		}
+		else {
+#pragma omp parallel
+#pragma omp single
+			subdivide(0, centroid_bounds, 1);
+		}
+
+		nodes.resize(node_count);
+		nodes.shrink_to_fit();
+	}
+
+	template<typename VB>
+	inline array_view<bvh_node> bvh<VB>::get_nodes() const
+	{
+		return node_view;
+	}
+
+	template<typename VB>
+	inline array_view<wide_bvh_node> bvh<VB>::get_wide_nodes() const
+	{
+		return wide_node_view;
+	}
+
+	template<typename VB>
+	inline array_view<triangle_block> bvh<VB>::get_triangle_blocks() const
+	{
+		return block_view;
+	}
+
+	template<typename VB>
+	inline array_view<triangle<VB>> bvh<VB>::get_triangles() const
+	{
+		return triangle_view;
+	}
+
+	template<typename VB>
+	inline std::vector<triangle_geometry> bvh<VB>::get_triangle_geometry() const
+	{
+		std::vector<triangle_geometry> result(triangle_view.size());
+		if (triangle_view.empty())
+			return result;
+
+		for (const wide_bvh_node& node: wide_node_view) {
+			for (unsigned i = 0; i < node.child_count; i++) {
+				for (unsigned first = 0; first < node.triangle_counts[i]; first += triangle_block_width) {
+					const triangle_block& block = block_view[node.children[i] + first / triangle_block_width];
+					const unsigned lane_count = std::min(triangle_block_width, node.triangle_counts[i] - first);
+					for (unsigned lane = 0; lane < lane_count; lane++)
+						result[block.triangle_ids[lane]] = block.get_triangle(lane);
+				}
+			}
+		}
+		return result;
+	}
+
+	template<typename VB>
+	inline array_view<unsigned> bvh<VB>::get_primitive_indices() const
+	{
+		return index_view;
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::update_views()
+	{
+		cache_file.reset();
+		node_view = nodes;
+		wide_node_view = wide_nodes;
+		block_view = triangle_blocks;
+		triangle_view = triangles;
+		index_view = triangle_indices;
+		source_view = source_triangles;
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::detach_cache()
+	{
+		if (!cache_file)
+			return;
+		nodes.assign(node_view.begin(), node_view.end());
+		wide_nodes.assign(wide_node_view.begin(), wide_node_view.end());
+		triangle_blocks.assign(block_view.begin(), block_view.end());
+		triangles.assign(triangle_view.begin(), triangle_view.end());
+		triangle_indices.assign(index_view.begin(), index_view.end());
+		source_triangles.assign(source_view.begin(), source_view.end());
+		update_views();
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::refit(const std::vector<triangle_geometry>& in_geometry,
+							   const std::vector<triangle<VB>>& in_triangles)
+	{
+		detach_cache();
+		if (nodes.empty())
+			return;
+
+		const int triangle_count = static_cast<int>(triangles.size());
+#pragma omp parallel for
+		for (int i = 0; i < triangle_count; i++)
+			triangles[i] = in_triangles[source_triangles[i]];
+
+#pragma omp parallel
+#pragma omp single
+		{
+			refit_node(0, in_geometry, 1);
+			refit_wide_node(0, in_geometry, 1);
+		}
+	}
+
+	template<typename VB>
+	inline float bvh<VB>::get_sah_cost() const
+	{
+		if (node_view.empty() || node_view[0].bounds.surface_area() <= 0.f)
+			return 0.f;
+
+		const int node_total = static_cast<int>(node_view.size());
+		float cost = 0.f;
+#pragma omp parallel for reduction(+ : cost)
+		for (int i = 0; i < node_total; i++) {
+			const float area = node_view[i].bounds.surface_area();
+			cost += node_view[i].is_leaf()
+							? area * static_cast<float>(node_view[i].triangle_count) * intersection_cost
+							: area * traversal_cost;
+		}
+		return cost / node_view[0].bounds.surface_area();
+	}
+
+	template<typename VB>
+	inline float bvh<VB>::get_build_sah_cost() const
+	{
+		return build_sah_cost;
+	}
+
+	template<typename VB>
+	inline aabb bvh<VB>::get_bounds(const triangle_geometry& triangle)
+	{
+		aabb bounds;
+		bounds.add_point(triangle.a);
+		bounds.add_point(triangle.a + triangle.ba);
+		bounds.add_point(triangle.a + triangle.ca);
+		return bounds;
+	}
+
+	// Nodes are refitted after both children, which are independent tasks
+	// near the root
+	template<typename VB>
+	inline aabb bvh<VB>::refit_node(unsigned node_id,
+									const std::vector<triangle_geometry>& in_geometry,
+									size_t depth)
+	{
+		bvh_node& node = nodes[node_id];
+		if (node.is_leaf()) {
+			node.bounds = aabb{};
+			for (unsigned i = 0; i < node.triangle_count; i++)
+				node.bounds.add_aabb(get_bounds(
+						in_geometry[source_triangles[triangle_indices[node.left_first + i]]]));
+			return node.bounds;
+		}
+
+		aabb left_bounds, right_bounds;
+		if (depth < refit_task_depth) {
+#pragma omp task shared(left_bounds, in_geometry) firstprivate(depth)
+			left_bounds = refit_node(node.left_first, in_geometry, depth + 1);
+			right_bounds = refit_node(node.left_first + 1, in_geometry, depth + 1);
+#pragma omp taskwait
+		}
+		else {
+			left_bounds = refit_node(node.left_first, in_geometry, depth + 1);
+			right_bounds = refit_node(node.left_first + 1, in_geometry, depth + 1);
+		}
+
+		node.bounds = left_bounds;
+		node.bounds.add_aabb(right_bounds);
+		return node.bounds;
+	}
+
+	template<typename VB>
+	inline aabb bvh<VB>::refit_wide_node(unsigned wide_id,
+										 const std::vector<triangle_geometry>& in_geometry,
+										 size_t depth)
+	{
+		wide_bvh_node& node = wide_nodes[wide_id];
+		aabb child_bounds[wide_bvh_width];
+
+		for (unsigned i = 0; i < node.child_count; i++) {
+			if (node.triangle_counts[i] == 0) {
+				if (depth < refit_task_depth) {
+#pragma omp task shared(child_bounds, in_geometry) firstprivate(i, depth)
+					child_bounds[i] = refit_wide_node(node.children[i], in_geometry, depth + 1);
+				}
+				else {
+					child_bounds[i] = refit_wide_node(node.children[i], in_geometry, depth + 1);
+				}
+				continue;
+			}
+
+			for (unsigned first = 0; first < node.triangle_counts[i]; first += triangle_block_width) {
+				triangle_block& block = triangle_blocks[node.children[i] + first / triangle_block_width];
+				const unsigned lane_count = std::min(triangle_block_width, node.triangle_counts[i] - first);
+				for (unsigned lane = 0; lane < lane_count; lane++) {
+					const triangle_geometry& source = in_geometry[source_triangles[block.triangle_ids[lane]]];
+					block.set_triangle(lane, source, block.triangle_ids[lane]);
+					child_bounds[i].add_aabb(get_bounds(source));
+				}
+			}
+		}
+#pragma omp taskwait
+
+		aabb bounds;
+		for (unsigned i = 0; i < node.child_count; i++) {
+			node.min_x[i] = child_bounds[i].aabb_min.x;
+			node.min_y[i] = child_bounds[i].aabb_min.y;
+			node.min_z[i] = child_bounds[i].aabb_min.z;
+			node.max_x[i] = child_bounds[i].aabb_max.x;
+			node.max_y[i] = child_bounds[i].aabb_max.y;
+			node.max_z[i] = child_bounds[i].aabb_max.z;
+			bounds.add_aabb(child_bounds[i]);
+		}
+		return bounds;
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::save(const std::filesystem::path& cache_path, uint64_t key) const
+	{
+		static_assert(std::is_trivially_copyable_v<triangle<VB>>,
+					  "Cached triangles are written as raw bytes");
+
+		std::error_code error;
+		if (cache_path.has_parent_path())
+			std::filesystem::create_directories(cache_path.parent_path(), error);
+
+		// Written next to the target and renamed, so readers never see a partial file
+		std::filesystem::path temporary_path = cache_path;
+		temporary_path += ".tmp";
+		std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+		if (!file) {
+			std::cerr << "Can't write the acceleration structure cache " << cache_path << "\n";
+			return;
+		}
+
+		cache_header header{};
+		std::memcpy(header.magic, cache_magic, sizeof(header.magic));
+		header.version = cache_version;
+		header.wide_width = wide_bvh_width;
+		header.block_width = triangle_block_width;
+		header.triangle_size = sizeof(triangle<VB>);
+		header.key = key;
+		header.node_count = node_view.size();
+		header.wide_node_count = wide_node_view.size();
+		header.block_count = block_view.size();
+		header.triangle_count = triangle_view.size();
+		header.reference_count = index_view.size();
+
+		size_t offset = 0;
+		auto write_section = [&](const void* data, size_t size) {
+			const char padding[cache_alignment] = {};
+			const size_t aligned_offset = (offset + cache_alignment - 1) / cache_alignment * cache_alignment;
+			file.write(padding, static_cast<std::streamsize>(aligned_offset - offset));
+			file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+			offset = aligned_offset + size;
+		};
+		write_section(&header, sizeof(header));
+		write_section(node_view.data(), node_view.size() * sizeof(bvh_node));
+		write_section(wide_node_view.data(), wide_node_view.size() * sizeof(wide_bvh_node));
+		write_section(block_view.data(), block_view.size() * sizeof(triangle_block));
+		write_section(triangle_view.data(), triangle_view.size() * sizeof(triangle<VB>));
+		write_section(index_view.data(), index_view.size() * sizeof(unsigned));
+		write_section(source_view.data(), source_view.size() * sizeof(unsigned));
+		file.close();
+
+		std::filesystem::rename(temporary_path, cache_path, error);
+		if (!file || error)
+			std::cerr << "Can't write the acceleration structure cache " << cache_path << "\n";
+	}
+
+	// Returns false when the file is missing, from another version or built
+	// for another key, leaving the BVH untouched
+	template<typename VB>
+	inline bool bvh<VB>::load(const std::filesystem::path& cache_path, uint64_t key)
+	{
+		auto file = std::make_unique<cg::utils::mapped_file>(cache_path);
+		if (!file->is_open() || file->get_size() < sizeof(cache_header))
+			return false;
+
+		cache_header header;
+		std::memcpy(&header, file->get_data(), sizeof(header));
+		if (std::memcmp(header.magic, cache_magic, sizeof(header.magic)) != 0 ||
+			header.version != cache_version || header.wide_width != wide_bvh_width ||
+			header.block_width != triangle_block_width ||
+			header.triangle_size != sizeof(triangle<VB>) || header.key != key)
+			return false;
+
+		size_t offset = sizeof(cache_header);
+		bool complete = true;
+		auto read_section = [&](auto& target, uint64_t count) {
+			using element = typename std::decay_t<decltype(target)>::value_type;
+			offset = (offset + cache_alignment - 1) / cache_alignment * cache_alignment;
+			const size_t size = static_cast<size_t>(count) * sizeof(element);
+			if (!complete || offset + size > file->get_size()) {
+				complete = false;
+				return;
+			}
+			// The mapping is page aligned and sections start at cache_alignment
+			target = array_view<element>(reinterpret_cast<const element*>(file->get_data() + offset),
+										 static_cast<size_t>(count));
+			offset += size;
+		};
+		array_view<bvh_node> cached_nodes;
+		array_view<wide_bvh_node> cached_wide_nodes;
+		array_view<triangle_block> cached_blocks;
+		array_view<triangle<VB>> cached_triangles;
+		array_view<unsigned> cached_indices;
+		array_view<unsigned> cached_sources;
+		read_section(cached_nodes, header.node_count);
+		read_section(cached_wide_nodes, header.wide_node_count);
+		read_section(cached_blocks, header.block_count);
+		read_section(cached_triangles, header.triangle_count);
+		read_section(cached_indices, header.reference_count);
+		read_section(cached_sources, header.triangle_count);
+		if (!complete)
+			return false;
+
+		nodes = {};
+		wide_nodes = {};
+		triangle_blocks = {};
+		triangles = {};
+		triangle_indices = {};
+		source_triangles = {};
+		cache_file = std::move(file);
+		node_view = cached_nodes;
+		wide_node_view = cached_wide_nodes;
+		block_view = cached_blocks;
+		triangle_view = cached_triangles;
+		index_view = cached_indices;
+		source_view = cached_sources;
+		build_sah_cost = get_sah_cost();
+		return true;
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::fill_bins(const bvh_node& node, const aabb& centroid_bounds,
+								   bin_set& bins) const
+	{
+		const float3 extent = centroid_bounds.aabb_max - centroid_bounds.aabb_min;
+		float3 scale;
+		for (int axis = 0; axis < 3; axis++)
+			scale[axis] = extent[axis] > 0.f ? bin_count / extent[axis] : 0.f;
+
+		auto fill_range = [&](unsigned first, unsigned last, bin_set& range_bins) {
+			for (unsigned i = first; i < last; i++) {
+				const unsigned index = triangle_indices[i];
+				const float3 centroid = centroids[index];
+				for (int axis = 0; axis < 3; axis++) {
+					int bin_id = static_cast<int>((centroid[axis] - centroid_bounds.aabb_min[axis]) * scale[axis]);
+					bin& target = range_bins[axis][std::min(bin_id, bin_count - 1)];
+					target.bounds.add_aabb(triangle_bounds[index]);
+					target.centroid_bounds.add_point(centroid);
+					target.triangle_count++;
+				}
+			}
+		};
+
+		const unsigned first = node.left_first;
+		const unsigned last = node.left_first + node.triangle_count;
+		if (node.triangle_count <= binning_chunk_size) {
+			fill_range(first, last, bins);
+			return;
+		}
+
+		// Large nodes are binned in chunks by separate tasks and merged afterwards
+		const unsigned chunk_count = (node.triangle_count + binning_chunk_size - 1) / binning_chunk_size;
+		std::vector<bin_set> chunk_bins(chunk_count);
+		for (unsigned chunk = 0; chunk < chunk_count; chunk++) {
+#pragma omp task shared(chunk_bins, fill_range) firstprivate(chunk)
+			fill_range(first + chunk * binning_chunk_size,
+					   std::min(last, first + (chunk + 1) * binning_chunk_size),
+					   chunk_bins[chunk]);
+		}
+#pragma omp taskwait
+
+		for (const auto& range_bins: chunk_bins) {
+			for (int axis = 0; axis < 3; axis++) {
+				for (int bin_id = 0; bin_id < bin_count; bin_id++) {
+					const bin& source = range_bins[axis][bin_id];
+					bin& target = bins[axis][bin_id];
+					target.bounds.add_aabb(source.bounds);
+					target.centroid_bounds.add_aabb(source.centroid_bounds);
+					target.triangle_count += source.triangle_count;
+				}
+			}
+		}
+	}
+
+	template<typename VB>
+	inline float bvh<VB>::find_best_split(const bin_set& bins, int& best_axis,
+										  int& best_bin) const
+	{
+		float best_cost = std::numeric_limits<float>::max();
+
+		for (int axis = 0; axis < 3; axis++) {
+			float right_areas[bin_count];
+			unsigned right_counts[bin_count];
+			aabb right_bounds;
+			unsigned right_count = 0;
+			for (int bin_id = bin_count - 1; bin_id > 0; bin_id--) {
+				right_bounds.add_aabb(bins[axis][bin_id].bounds);
+				right_count += bins[axis][bin_id].triangle_count;
+				right_areas[bin_id] = right_bounds.surface_area();
+				right_counts[bin_id] = right_count;
+			}
+
+			aabb left_bounds;
+			unsigned left_count = 0;
+			for (int bin_id = 1; bin_id < bin_count; bin_id++) {
+				left_bounds.add_aabb(bins[axis][bin_id - 1].bounds);
+				left_count += bins[axis][bin_id - 1].triangle_count;
+				if (left_count == 0 || right_counts[bin_id] == 0)
+					continue;
+
+				float cost = left_bounds.surface_area() * static_cast<float>(left_count) +
+							 right_areas[bin_id] * static_cast<float>(right_counts[bin_id]);
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = bin_id;
+				}
+			}
+		}
+
+		return best_cost;
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::subdivide(unsigned node_id, const aabb& centroid_bounds,
+								   size_t depth)
+	{
+		const bvh_node node = nodes[node_id];
+		if (node.triangle_count <= 1 || depth >= max_depth)
+			return;
+
+		bin_set bins{};
+		fill_bins(node, centroid_bounds, bins);
+
+		int axis = -1;
+		int split_bin = 0;
+		float split_cost = find_best_split(bins, axis, split_bin);
+
+		const float leaf_cost = static_cast<float>(node.triangle_count) * intersection_cost;
+		const float parent_area = node.bounds.surface_area();
+		if (axis >= 0 && parent_area > 0.f)
+			split_cost = traversal_cost + intersection_cost * split_cost / parent_area;
+		if (split_cost >= leaf_cost && node.triangle_count <= max_leaf_size)
+			return;
+
+		aabb left_bounds, right_bounds;
+		aabb left_centroids, right_centroids;
+		unsigned left_count = 0;
+		if (axis >= 0) {
+			for (int bin_id = 0; bin_id < bin_count; bin_id++) {
+				const bin& source = bins[axis][bin_id];
+				aabb& bounds = bin_id < split_bin ? left_bounds : right_bounds;
+				aabb& centroids_bounds = bin_id < split_bin ? left_centroids : right_centroids;
+				bounds.add_aabb(source.bounds);
+				centroids_bounds.add_aabb(source.centroid_bounds);
+				if (bin_id < split_bin)
+					left_count += source.triangle_count;
+			}
+
+			const float axis_min = centroid_bounds.aabb_min[axis];
+			const float scale = bin_count / (centroid_bounds.aabb_max[axis] - axis_min);
+			auto begin = triangle_indices.begin() + node.left_first;
+			std::partition(begin, begin + node.triangle_count, [&](unsigned index) {
+				int bin_id = static_cast<int>((centroids[index][axis] - axis_min) * scale);
+				return std::min(bin_id, bin_count - 1) < split_bin;
+			});
+		}
+		else {
+			// All centroids coincide, so any split is as good as another one
+			left_count = node.triangle_count / 2;
+			for (unsigned i = 0; i < node.triangle_count; i++) {
+				const unsigned index = triangle_indices[node.left_first + i];
+				aabb& bounds = i < left_count ? left_bounds : right_bounds;
+				aabb& centroids_bounds = i < left_count ? left_centroids : right_centroids;
+				bounds.add_aabb(triangle_bounds[index]);
+				centroids_bounds.add_point(centroids[index]);
+			}
+		}
+
+		const unsigned left_id = node_count.fetch_add(2);
+		nodes[left_id].bounds = left_bounds;
+		nodes[left_id].left_first = node.left_first;
+		nodes[left_id].triangle_count = left_count;
+		nodes[left_id + 1].bounds = right_bounds;
+		nodes[left_id + 1].left_first = node.left_first + left_count;
+		nodes[left_id + 1].triangle_count = node.triangle_count - left_count;
+
+		nodes[node_id].left_first = left_id;
+		nodes[node_id].triangle_count = 0;
+
+		if (node.triangle_count > task_threshold) {
+#pragma omp task firstprivate(left_id, left_centroids, depth)
+			subdivide(left_id, left_centroids, depth + 1);
+#pragma omp task firstprivate(left_id, right_centroids, depth)
+			subdivide(left_id + 1, right_centroids, depth + 1);
+		}
+		else {
+			subdivide(left_id, left_centroids, depth + 1);
+			subdivide(left_id + 1, right_centroids, depth + 1);
+		}
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::collapse()
+	{
+		wide_nodes.reserve(nodes.size() / 2 + 1);
+		collapse_node(0);
+		wide_nodes.shrink_to_fit();
+		triangle_blocks.shrink_to_fit();
+	}
+
+	// Pulls up the grandchildren of the largest inner children until the
+	// wide node is full, then collapses the remaining inner children recursively
+	template<typename VB>
+	inline unsigned bvh<VB>::collapse_node(unsigned node_id)
+	{
+		unsigned children[wide_bvh_width];
+		unsigned child_count = 0;
+		if (nodes[node_id].is_leaf()) {
+			children[child_count++] = node_id;
+		}
+		else {
+			children[child_count++] = nodes[node_id].left_first;
+			children[child_count++] = nodes[node_id].left_first + 1;
+		}
+
+		while (child_count < wide_bvh_width) {
+			int largest = -1;
+			float largest_area = -1.f;
+			for (unsigned i = 0; i < child_count; i++) {
+				const bvh_node& child = nodes[children[i]];
+				if (!child.is_leaf() && child.bounds.surface_area() > largest_area) {
+					largest_area = child.bounds.surface_area();
+					largest = static_cast<int>(i);
+				}
+			}
+			if (largest < 0)
+				break;
+
+			const unsigned left_id = nodes[children[largest]].left_first;
+			children[largest] = left_id;
+			children[child_count++] = left_id + 1;
+		}
+
+		const unsigned wide_id = static_cast<unsigned>(wide_nodes.size());
+		wide_nodes.emplace_back();
+		wide_nodes[wide_id].child_count = child_count;
+
+		for (unsigned i = 0; i < wide_bvh_width; i++) {
+			wide_bvh_node& wide_node = wide_nodes[wide_id];
+			if (i >= child_count) {
+				wide_node.min_x[i] = wide_node.min_y[i] = wide_node.min_z[i] = std::numeric_limits<float>::max();
+				wide_node.max_x[i] = wide_node.max_y[i] = wide_node.max_z[i] = std::numeric_limits<float>::lowest();
+				wide_node.children[i] = 0;
+				wide_node.triangle_counts[i] = 0;
+				continue;
+			}
+
+			const bvh_node& child = nodes[children[i]];
+			wide_node.min_x[i] = child.bounds.aabb_min.x;
+			wide_node.min_y[i] = child.bounds.aabb_min.y;
+			wide_node.min_z[i] = child.bounds.aabb_min.z;
+			wide_node.max_x[i] = child.bounds.aabb_max.x;
+			wide_node.max_y[i] = child.bounds.aabb_max.y;
+			wide_node.max_z[i] = child.bounds.aabb_max.z;
+			wide_node.triangle_counts[i] = child.triangle_count;
+			if (child.is_leaf() && geometry.empty()) {
+				// Trees over boxes point leaves straight into the primitive order
+				wide_node.children[i] = child.left_first;
+			}
+			else if (child.is_leaf()) {
+				wide_node.children[i] = static_cast<unsigned>(triangle_blocks.size());
+				for (unsigned first = 0; first < child.triangle_count; first += triangle_block_width) {
+					// Unused lanes keep degenerate zero triangles, which never pass the test
+					triangle_block& block = triangle_blocks.emplace_back();
+					const unsigned lane_count = std::min(triangle_block_width, child.triangle_count - first);
+					for (unsigned lane = 0; lane < lane_count; lane++) {
+						const unsigned triangle_id = triangle_indices[child.left_first + first + lane];
+						block.set_triangle(lane, geometry[triangle_id], triangle_id);
+					}
+				}
+			}
+			else {
+				// The recursion may grow wide_nodes, so the reference is taken again
+				unsigned child_wide_id = collapse_node(children[i]);
+				wide_nodes[wide_id].children[i] = child_wide_id;
+			}
+		}
+
+		return wide_id;
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::subdivide_spatial(unsigned node_id, std::vector<reference> references,
+										   size_t depth)
+	{
+		bvh_node& node = nodes[node_id];
+		const unsigned count = static_cast<unsigned>(references.size());
+		auto make_leaf = [&]() {
+			node.left_first = static_cast<unsigned>(triangle_indices.size());
+			node.triangle_count = count;
+			for (const reference& source: references)
+				triangle_indices.push_back(source.triangle);
+		};
+		if (count <= 1 || depth >= max_depth)
+			return make_leaf();
+
+		int object_axis = -1;
+		float object_position = 0.f;
+		aabb object_left, object_right;
+		const float object_cost = find_object_split(references, object_axis, object_position,
+													object_left, object_right);
+
+		// A split may duplicate every reference of the node, so the whole
+		// node has to fit into the remaining budget
+		int spatial_axis = -1;
+		float spatial_position = 0.f;
+		float spatial_cost = std::numeric_limits<float>::max();
+		object_left.clip(object_right);
+		if (reference_count + count <= reference_limit &&
+			(object_axis < 0 || object_left.surface_area() > spatial_split_overlap * root_area))
+			spatial_cost = find_spatial_split(references, node.bounds, spatial_axis, spatial_position);
+
+		const bool spatial = spatial_axis >= 0 && spatial_cost < object_cost;
+		const float leaf_cost = static_cast<float>(count) * intersection_cost;
+		const float parent_area = node.bounds.surface_area();
+		float split_cost = std::numeric_limits<float>::max();
+		if ((spatial || object_axis >= 0) && parent_area > 0.f)
+			split_cost = traversal_cost +
+						 intersection_cost * std::min(object_cost, spatial_cost) / parent_area;
+		if (split_cost >= leaf_cost && count <= max_leaf_size)
+			return make_leaf();
+
+		std::vector<reference> left_references, right_references;
+		if (spatial) {
+			// References straddling the plane are clipped into both sides,
+			// unless keeping them whole on one side is cheaper
+			aabb left_bounds, right_bounds;
+			unsigned left_count = 0, right_count = 0;
+			for (const reference& source: references) {
+				if (source.bounds.aabb_min[spatial_axis] < spatial_position) {
+					left_bounds.add_aabb(source.bounds);
+					left_count++;
+				}
+				if (source.bounds.aabb_max[spatial_axis] > spatial_position) {
+					right_bounds.add_aabb(source.bounds);
+					right_count++;
+				}
+			}
+			left_bounds.aabb_max[spatial_axis] = std::min(left_bounds.aabb_max[spatial_axis], spatial_position);
+			right_bounds.aabb_min[spatial_axis] = std::max(right_bounds.aabb_min[spatial_axis], spatial_position);
+
+			const float split_area = left_bounds.surface_area() * static_cast<float>(left_count) +
+									 right_bounds.surface_area() * static_cast<float>(right_count);
+			for (const reference& source: references) {
+				if (source.bounds.aabb_max[spatial_axis] <= spatial_position) {
+					left_references.push_back(source);
+					continue;
+				}
+				if (source.bounds.aabb_min[spatial_axis] >= spatial_position) {
+					right_references.push_back(source);
+					continue;
+				}
+
+				aabb left_union = left_bounds;
+				left_union.add_aabb(source.bounds);
+				aabb right_union = right_bounds;
+				right_union.add_aabb(source.bounds);
+				const float left_area = left_union.surface_area() * static_cast<float>(left_count) +
+										right_bounds.surface_area() * static_cast<float>(right_count - 1);
+				const float right_area = left_bounds.surface_area() * static_cast<float>(left_count - 1) +
+										 right_union.surface_area() * static_cast<float>(right_count);
+				if (left_area < split_area && left_area <= right_area) {
+					left_references.push_back(source);
+				}
+				else if (right_area < split_area) {
+					right_references.push_back(source);
+				}
+				else {
+					reference left, right;
+					split_reference(source, spatial_axis, spatial_position, left, right);
+					left_references.push_back(left);
+					right_references.push_back(right);
+					reference_count++;
+				}
+			}
+		}
+		else if (object_axis >= 0) {
+			for (const reference& source: references) {
+				const float centroid = (source.bounds.aabb_min[object_axis] + source.bounds.aabb_max[object_axis]) * 0.5f;
+				(centroid < object_position ? left_references : right_references).push_back(source);
+			}
+		}
+
+		// All centroids coincide, so any split is as good as another one
+		if (left_references.empty() || right_references.empty()) {
+			left_references.assign(references.begin(), references.begin() + count / 2);
+			right_references.assign(references.begin() + count / 2, references.end());
+		}
+		references = {};
+
+		const unsigned left_id = node_count.fetch_add(2);
+		for (unsigned child_id = left_id; child_id <= left_id + 1; child_id++) {
+			const auto& child_references = child_id == left_id ? left_references : right_references;
+			nodes[child_id].bounds = aabb{};
+			for (const reference& source: child_references)
+				nodes[child_id].bounds.add_aabb(source.bounds);
+		}
+		// nodes may not be resized during the build, so the reference stays valid
+		node.left_first = left_id;
+		node.triangle_count = 0;
+
+		subdivide_spatial(left_id, std::move(left_references), depth + 1);
+		subdivide_spatial(left_id + 1, std::move(right_references), depth + 1);
+	}
+
+	// Binned surface area heuristic over the reference centroids. Returns the
+	// area-weighted cost, best_axis stays -1 when all centroids coincide.
+	template<typename VB>
+	inline float bvh<VB>::find_object_split(const std::vector<reference>& references,
+											int& best_axis, float& best_position,
+											aabb& left_bounds, aabb& right_bounds) const
+	{
+		aabb centroid_bounds;
+		for (const reference& source: references)
+			centroid_bounds.add_point((source.bounds.aabb_min + source.bounds.aabb_max) * 0.5f);
+
+		const float3 extent = centroid_bounds.aabb_max - centroid_bounds.aabb_min;
+		float3 scale;
+		for (int axis = 0; axis < 3; axis++)
+			scale[axis] = extent[axis] > 0.f ? bin_count / extent[axis] : 0.f;
+
+		bin_set bins{};
+		for (const reference& source: references) {
+			const float3 centroid = (source.bounds.aabb_min + source.bounds.aabb_max) * 0.5f;
+			for (int axis = 0; axis < 3; axis++) {
+				int bin_id = static_cast<int>((centroid[axis] - centroid_bounds.aabb_min[axis]) * scale[axis]);
+				bin& target = bins[axis][std::min(bin_id, bin_count - 1)];
+				target.bounds.add_aabb(source.bounds);
+				target.centroid_bounds.add_point(centroid);
+				target.triangle_count++;
+			}
+		}
+
+		int best_bin = 0;
+		const float best_cost = find_best_split(bins, best_axis, best_bin);
+		if (best_axis < 0)
+			return best_cost;
+
+		// Splitting halfway between the centroids on both sides of the bin
+		// border keeps the partition identical to the binning
+		aabb left_centroids, right_centroids;
+		for (int bin_id = 0; bin_id < bin_count; bin_id++) {
+			const bin& source = bins[best_axis][bin_id];
+			(bin_id < best_bin ? left_bounds : right_bounds).add_aabb(source.bounds);
+			(bin_id < best_bin ? left_centroids : right_centroids).add_aabb(source.centroid_bounds);
+		}
+		best_position = (left_centroids.aabb_max[best_axis] + right_centroids.aabb_min[best_axis]) * 0.5f;
+		return best_cost;
+	}
+
+	// Bins clipped references along each axis of the node box, counting
+	// where every reference enters and exits. Returns the area-weighted cost.
+	template<typename VB>
+	inline float bvh<VB>::find_spatial_split(const std::vector<reference>& references,
+											 const aabb& node_bounds, int& best_axis,
+											 float& best_position) const
+	{
+		float best_cost = std::numeric_limits<float>::max();
+
+		for (int axis = 0; axis < 3; axis++) {
+			const float axis_min = node_bounds.aabb_min[axis];
+			const float extent = node_bounds.aabb_max[axis] - axis_min;
+			if (extent <= 0.f)
+				continue;
+			const float scale = bin_count / extent;
+			auto plane = [&](int bin_id) { return axis_min + extent * static_cast<float>(bin_id) / bin_count; };
+
+			aabb bin_bounds[bin_count];
+			unsigned entries[bin_count] = {};
+			unsigned exits[bin_count] = {};
+			for (const reference& source: references) {
+				const int first = std::clamp(static_cast<int>((source.bounds.aabb_min[axis] - axis_min) * scale), 0, bin_count - 1);
+				const int last = std::clamp(static_cast<int>((source.bounds.aabb_max[axis] - axis_min) * scale), first, bin_count - 1);
+
+				reference remaining = source;
+				for (int bin_id = first; bin_id < last; bin_id++) {
+					reference left, right;
+					split_reference(remaining, axis, plane(bin_id + 1), left, right);
+					bin_bounds[bin_id].add_aabb(left.bounds);
+					remaining = right;
+				}
+				bin_bounds[last].add_aabb(remaining.bounds);
+				entries[first]++;
+				exits[last]++;
+			}
+
+			float right_areas[bin_count];
+			unsigned right_counts[bin_count];
+			aabb right_bounds;
+			unsigned right_count = 0;
+			for (int bin_id = bin_count - 1; bin_id > 0; bin_id--) {
+				right_bounds.add_aabb(bin_bounds[bin_id]);
+				right_count += exits[bin_id];
+				right_areas[bin_id] = right_bounds.surface_area();
+				right_counts[bin_id] = right_count;
+			}
+
+			aabb left_bounds;
+			unsigned left_count = 0;
+			for (int bin_id = 1; bin_id < bin_count; bin_id++) {
+				left_bounds.add_aabb(bin_bounds[bin_id - 1]);
+				left_count += entries[bin_id - 1];
+				if (left_count == 0 || right_counts[bin_id] == 0)
+					continue;
+
+				float cost = left_bounds.surface_area() * static_cast<float>(left_count) +
+							 right_areas[bin_id] * static_cast<float>(right_counts[bin_id]);
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_position = plane(bin_id);
+				}
+			}
+		}
+
+		return best_cost;
+	}
+
+	// Clips the triangle polygon at the plane and bounds each side within
+	// the box the reference already had
+	template<typename VB>
+	inline void bvh<VB>::split_reference(const reference& source, int axis, float position,
+										 reference& left, reference& right) const
+	{
+		left = {aabb{}, source.triangle};
+		right = {aabb{}, source.triangle};
+
+		const triangle_geometry& triangle = geometry[source.triangle];
+		const float3 vertices[3] = {triangle.a, triangle.a + triangle.ba, triangle.a + triangle.ca};
+		for (int i = 0; i < 3; i++) {
+			const float3& from = vertices[i];
+			const float3& to = vertices[(i + 1) % 3];
+			if (from[axis] <= position)
+				left.bounds.add_point(from);
+			if (from[axis] >= position)
+				right.bounds.add_point(from);
+			if ((from[axis] < position && position < to[axis]) ||
+				(to[axis] < position && position < from[axis])) {
+				const float t = std::clamp((position - from[axis]) / (to[axis] - from[axis]), 0.f, 1.f);
+				const float3 crossing = from + (to - from) * t;
+				left.bounds.add_point(crossing);
+				right.bounds.add_point(crossing);
+			}
+		}
+
+		left.bounds.aabb_max[axis] = std::min(left.bounds.aabb_max[axis], position);
+		right.bounds.aabb_min[axis] = std::max(right.bounds.aabb_min[axis], position);
+		left.bounds.clip(source.bounds);
+		right.bounds.clip(source.bounds);
+	}
+
+	// Spreads the lower 21 bits of the value so that two zero bits follow each one
+	template<typename VB>
+	inline uint64_t bvh<VB>::expand_bits(uint64_t value)
+	{
+		value &= 0x1fffff;
+		value = (value | value << 32) & 0x1f00000000ffff;
+		value = (value | value << 16) & 0x1f0000ff0000ff;
+		value = (value | value << 8) & 0x100f00f00f00f00f;
+		value = (value | value << 4) & 0x10c30c30c30c30c3;
+		value = (value | value << 2) & 0x1249249249249249;
+		return value;
+	}
+
+	// Interleaves 21 bits per axis of a position in the unit cube into a 63-bit code
+	template<typename VB>
+	inline uint64_t bvh<VB>::morton_code(const float3& normalized_position)
+	{
+		constexpr float grid_size = static_cast<float>(1 << 21);
+		float3 cell = clamp(normalized_position * grid_size, 0.f, grid_size - 1.f);
+		return expand_bits(static_cast<uint64_t>(cell.x)) << 2 |
+			   expand_bits(static_cast<uint64_t>(cell.y)) << 1 |
+			   expand_bits(static_cast<uint64_t>(cell.z));
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::sort_by_morton_codes(const aabb& centroid_bounds)
+	{
+		const int triangle_count = static_cast<int>(triangle_indices.size());
+		const float3 extent = centroid_bounds.aabb_max - centroid_bounds.aabb_min;
+		float3 scale;
+		for (int axis = 0; axis < 3; axis++)
+			scale[axis] = extent[axis] > 0.f ? 1.f / extent[axis] : 0.f;
+
+		std::vector<morton_key> keys(triangle_count);
+		std::vector<morton_key> sorted_keys(triangle_count);
+#pragma omp parallel for
+		for (int i = 0; i < triangle_count; i++)
+			keys[i] = {morton_code((centroids[i] - centroid_bounds.aabb_min) * scale),
+					   static_cast<unsigned>(i)};
+
+		// Parallel LSD radix sort, 8 bits per pass: every thread histograms its
+		// own contiguous chunk and scatters it to offsets derived from all histograms
+		constexpr int radix_bits = 8;
+		constexpr int radix_size = 1 << radix_bits;
+		constexpr int pass_count = (63 + radix_bits - 1) / radix_bits;
+		const int thread_count = omp_get_max_threads();
+		std::vector<std::array<size_t, radix_size>> histograms(thread_count);
+
+		for (int pass = 0; pass < pass_count; pass++) {
+			const int shift = pass * radix_bits;
+#pragma omp parallel num_threads(thread_count)
+			{
+				const int thread_id = omp_get_thread_num();
+				const int threads = omp_get_num_threads();
+				const int first = static_cast<int>(static_cast<int64_t>(triangle_count) * thread_id / threads);
+				const int last = static_cast<int>(static_cast<int64_t>(triangle_count) * (thread_id + 1) / threads);
+
+				auto& histogram = histograms[thread_id];
+				histogram.fill(0);
+				for (int i = first; i < last; i++)
+					histogram[(keys[i].code >> shift) & (radix_size - 1)]++;
+
+#pragma omp barrier
+#pragma omp single
+				{
+					size_t offset = 0;
+					for (int digit = 0; digit < radix_size; digit++) {
+						for (int t = 0; t < threads; t++) {
+							size_t count = histograms[t][digit];
+							histograms[t][digit] = offset;
+							offset += count;
+						}
+					}
+				}
+
+				for (int i = first; i < last; i++)
+					sorted_keys[histogram[(keys[i].code >> shift) & (radix_size - 1)]++] = keys[i];
+			}
+			keys.swap(sorted_keys);
+		}
+
+		morton_codes.resize(triangle_count);
+#pragma omp parallel for
+		for (int i = 0; i < triangle_count; i++) {
+			morton_codes[i] = keys[i].code;
+			triangle_indices[i] = keys[i].index;
+		}
+	}
+
+	template<typename VB>
+	inline void bvh<VB>::emit_lbvh(unsigned node_id, size_t depth)
 	{
-		float2 result{0.f, 0.f};
+		const bvh_node node = nodes[node_id];
+		if (node.triangle_count <= lbvh_leaf_size || depth >= max_depth)
+			return;
+
+		const unsigned first = node.left_first;
+		const unsigned last = first + node.triangle_count - 1;
+		unsigned split = first + node.triangle_count / 2;
+
+		// Split where the highest differing bit of the sorted codes flips,
+		// found by a binary search for the last code sharing the longer prefix
+		const uint64_t first_code = morton_codes[first];
+		const uint64_t last_code = morton_codes[last];
+		if (first_code != last_code) {
+			uint64_t prefix_mask = first_code ^ last_code;
+			for (int shift = 1; shift < 64; shift <<= 1)
+				prefix_mask |= prefix_mask >> shift;
+			prefix_mask = ~(prefix_mask >> 1);
+			const uint64_t left_prefix = first_code & prefix_mask;
+
+			unsigned low = first;
+			unsigned high = last;
+			while (low + 1 < high) {
+				unsigned middle = (low + high) / 2;
+				if ((morton_codes[middle] & prefix_mask) == left_prefix)
+					low = middle;
+				else
+					high = middle;
+			}
+			split = low + 1;
+		}
 
-		int adjusted_id = frame_id + 1;
+		const unsigned left_count = split - first;
+		const unsigned left_id = node_count.fetch_add(2);
+		nodes[left_id].left_first = first;
+		nodes[left_id].triangle_count = left_count;
+		nodes[left_id + 1].left_first = split;
+		nodes[left_id + 1].triangle_count = node.triangle_count - left_count;
 
-		constexpr int x_base = 2;
-		float x_inv_base = 1.f / static_cast<float>(x_base);
-		float x_fraction = x_inv_base;
+		nodes[node_id].left_first = left_id;
+		nodes[node_id].triangle_count = 0;
+
+		if (node.triangle_count > task_threshold) {
+#pragma omp task firstprivate(left_id, depth)
+			emit_lbvh(left_id, depth + 1);
+#pragma omp task firstprivate(left_id, depth)
+			emit_lbvh(left_id + 1, depth + 1);
+#pragma omp taskwait
+		}
+		else {
+			emit_lbvh(left_id, depth + 1);
+			emit_lbvh(left_id + 1, depth + 1);
+		}
 
-		int x_index = adjusted_id;
-		while (x_index > 0) {
-			result.x += (x_index % x_base) * x_fraction;
-			x_index /= x_base;
-			x_fraction *= x_inv_base;
+		// Bounds are gathered bottom-up once both subtrees are complete
+		for (unsigned child_id = left_id; child_id <= left_id + 1; child_id++) {
+			bvh_node& child = nodes[child_id];
+			if (child.is_leaf()) {
+				child.bounds = aabb{};
+				for (unsigned i = 0; i < child.triangle_count; i++)
+					child.bounds.add_aabb(triangle_bounds[triangle_indices[child.left_first + i]]);
+			}
 		}
+		nodes[node_id].bounds = nodes[left_id].bounds;
+		nodes[node_id].bounds.add_aabb(nodes[left_id + 1].bounds);
+	}
+
+	inline ray instance::to_object_space(const ray& world_ray) const
+	{
+		ray object_ray;
+		object_ray.position = mul(world_to_object, float4{world_ray.position, 1.f}).xyz();
+		object_ray.direction = mul(world_to_object, float4{world_ray.direction, 0.f}).xyz();
+		object_ray.inv_direction = 1.f / object_ray.direction;
+		return object_ray;
+	}
+
+	template<typename VB>
+	inline unsigned top_level_bvh<VB>::add_bottom_level(std::shared_ptr<bvh<VB>> bottom_level)
+	{
+		bottom_levels.push_back(bottom_level);
+		return static_cast<unsigned>(bottom_levels.size() - 1);
+	}
+
+	template<typename VB>
+	inline unsigned top_level_bvh<VB>::add_instance(unsigned bottom_level,
+													const float4x4& object_to_world)
+	{
+		instances.emplace_back();
+		instances.back().bottom_level = bottom_level;
+		set_transform(static_cast<unsigned>(instances.size() - 1), object_to_world);
+		return static_cast<unsigned>(instances.size() - 1);
+	}
 
-		constexpr int y_base = 3;
-		float y_inv_base = 1.f / static_cast<float>(y_base);
-		float y_fraction = y_inv_base;
+	template<typename VB>
+	inline void top_level_bvh<VB>::set_transform(unsigned instance_id,
+												 const float4x4& object_to_world)
+	{
+		instance& placement = instances[instance_id];
+		placement.object_to_world = object_to_world;
+		placement.world_to_object = inverse(object_to_world);
+		placement.identity = object_to_world == identity_transform();
+		update_bounds(placement);
+	}
 
-		int y_index = adjusted_id;
-		while (y_index > 0) {
-			result.y += (y_index % y_base) * y_fraction;
-			y_index /= y_base;
-			y_fraction *= y_inv_base;
+	// World bounds enclose the transformed corners of the object space root box
+	template<typename VB>
+	inline void top_level_bvh<VB>::update_bounds(instance& placement) const
+	{
+		placement.bounds = aabb{};
+		const auto& nodes = bottom_levels[placement.bottom_level]->get_nodes();
+		if (nodes.empty())
+			return;
+		const aabb& object_bounds = nodes[0].bounds;
+		for (int corner = 0; corner < 8; corner++) {
+			const float3 point{
+					corner & 1 ? object_bounds.aabb_max.x : object_bounds.aabb_min.x,
+					corner & 2 ? object_bounds.aabb_max.y : object_bounds.aabb_min.y,
+					corner & 4 ? object_bounds.aabb_max.z : object_bounds.aabb_min.z};
+			placement.bounds.add_point(mul(placement.object_to_world, float4{point, 1.f}).xyz());
 		}
+	}
 
-		return result - 0.5f;
+	template<typename VB>
+	inline void top_level_bvh<VB>::refit()
+	{
+		for (instance& placement: instances)
+			update_bounds(placement);
+		build();
 	}
 
 	template<typename VB>
-	inline void aabb<VB>::add_triangle(const triangle<VB> triangle)
+	inline void top_level_bvh<VB>::build()
 	{
-		if (triangles.empty()) {
-			aabb_max = aabb_min = triangle.a;
+		// Instances of empty bottom levels have no bounds and stay out of the tree
+		std::vector<aabb> bounds;
+		std::vector<unsigned> placed_instances;
+		for (unsigned instance_id = 0; instance_id < instances.size(); instance_id++) {
+			if (instances[instance_id].bounds.is_empty())
+				continue;
+			bounds.push_back(instances[instance_id].bounds);
+			placed_instances.push_back(instance_id);
 		}
 
-		triangles.push_back(triangle);
+		tree.build(bounds);
+
+		const auto& primitive_indices = tree.get_primitive_indices();
+		leaf_instances.resize(primitive_indices.size());
+		for (size_t i = 0; i < primitive_indices.size(); i++)
+			leaf_instances[i] = placed_instances[primitive_indices[i]];
+	}
+
+	template<typename VB>
+	inline bool top_level_bvh<VB>::is_single_level() const
+	{
+		return instances.size() == 1 && instances[0].identity;
+	}
+
+	// Shading normals follow the inverse transpose of the instance transform
+	template<typename VB>
+	inline triangle<VB> top_level_bvh<VB>::get_world_triangle(
+			const triangle<VB>& object_triangle, unsigned instance_id) const
+	{
+		const instance& placement = instances[instance_id];
+		if (placement.identity)
+			return object_triangle;
+
+		const float4x4 normal_matrix = transpose(placement.world_to_object);
+		triangle<VB> world_triangle = object_triangle;
+		world_triangle.na = normalize(mul(normal_matrix, float4{object_triangle.na, 0.f}).xyz());
+		world_triangle.nb = normalize(mul(normal_matrix, float4{object_triangle.nb, 0.f}).xyz());
+		world_triangle.nc = normalize(mul(normal_matrix, float4{object_triangle.nc, 0.f}).xyz());
+		return world_triangle;
+	}
+
+	template<typename VB>
+	inline triangle_geometry top_level_bvh<VB>::get_world_geometry(
+			const triangle_geometry& object_geometry, unsigned instance_id) const
+	{
+		const instance& placement = instances[instance_id];
+		if (placement.identity)
+			return object_geometry;
+
+		triangle_geometry world_geometry;
+		world_geometry.a = mul(placement.object_to_world, float4{object_geometry.a, 1.f}).xyz();
+		world_geometry.ba = mul(placement.object_to_world, float4{object_geometry.ba, 0.f}).xyz();
+		world_geometry.ca = mul(placement.object_to_world, float4{object_geometry.ca, 0.f}).xyz();
+		return world_geometry;
+	}
 
-		aabb_max = max(aabb_max, triangle.a);
-		aabb_max = max(aabb_max, triangle.b);
-		aabb_max = max(aabb_max, triangle.c);
+	template<typename VB>
+	inline const std::vector<std::shared_ptr<bvh<VB>>>& top_level_bvh<VB>::get_bottom_levels() const
+	{
+		return bottom_levels;
+	}
 
-		aabb_min = min(aabb_min, triangle.a);
-		aabb_min = min(aabb_min, triangle.b);
-		aabb_min = min(aabb_min, triangle.c);
+	template<typename VB>
+	inline const std::vector<instance>& top_level_bvh<VB>::get_instances() const
+	{
+		return instances;
 	}
 
 	template<typename VB>
-	inline const std::vector<triangle<VB>>& aabb<VB>::get_triangles() const
+	inline const bvh<VB>& top_level_bvh<VB>::get_tree() const
 	{
-		return triangles;
+		return tree;
 	}
 
 	template<typename VB>
-	inline bool aabb<VB>::aabb_test(const ray& ray) const
+	inline const std::vector<unsigned>& top_level_bvh<VB>::get_leaf_instances() const
 	{
-		float3 reciprocal_dir = 1.f / ray.direction;
-		float3 t_far = (aabb_max - ray.position) * reciprocal_dir;
-		float3 t_near = (aabb_min - ray.position) * reciprocal_dir;
-		float3 t_min = min(t_near, t_far);
-		float3 t_max = max(t_near, t_far);
-		return maxelem(t_min) <= minelem(t_max);
+		return leaf_instances;
 	}
 
 }// namespace cg::renderer
\ No newline at end of file
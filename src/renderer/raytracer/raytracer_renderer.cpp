@@ -1,32 +1,162 @@
 #include "raytracer_renderer.h"
 
+#include "renderer/raytracer/sampling.h"
+#include "utils/error_handler.h"
+#include "utils/file_utils.h"
 #include "utils/resource_utils.h"
 
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 
 
 void cg::renderer::ray_tracing_renderer::init_raytracer()
 {
   raytracer = std::make_shared<
-      cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+      cg::renderer::raytracer<cg::vertex, cg::float_color>>();
   raytracer->set_viewport(settings->width, settings->height);
 
-  render_target = std::make_shared<cg::resource<cg::unsigned_color>>(
+  render_target = std::make_shared<cg::resource<cg::float_color>>(
       settings->width, settings->height);
 
   raytracer->set_render_target(render_target);
+
+  if (settings->bvh_builder == "sah")
+    raytracer->set_build_mode(bvh_build_mode::sah);
+  else if (settings->bvh_builder == "lbvh")
+    raytracer->set_build_mode(bvh_build_mode::lbvh);
+  else if (settings->bvh_builder == "sbvh")
+    raytracer->set_build_mode(bvh_build_mode::sbvh);
+  else
+    THROW_ERROR("Unknown BVH builder: " + settings->bvh_builder);
+
+  if (settings->integrator == "recursive")
+    raytracer->set_integrator(integrator_mode::recursive);
+  else if (settings->integrator == "wavefront")
+    raytracer->set_integrator(integrator_mode::wavefront);
+  else
+    THROW_ERROR("Unknown integrator: " + settings->integrator);
+
+  if (settings->sampler == "random")
+    raytracer->set_sampler(sampler_type::random);
+  else if (settings->sampler == "sobol")
+    raytracer->set_sampler(sampler_type::sobol);
+  else if (settings->sampler == "lattice")
+    raytracer->set_sampler(sampler_type::lattice);
+  else if (settings->sampler == "halton")
+    raytracer->set_sampler(sampler_type::halton);
+  else
+    THROW_ERROR("Unknown sampler: " + settings->sampler);
+
+  raytracer->set_adaptive_sampling(settings->adaptive_noise, settings->sample_budget);
+  raytracer->set_roulette_depth(settings->roulette_depth);
+  raytracer->set_denoise_iterations(settings->denoise_iterations);
+
+  if (!settings->preview_path.empty() &&
+      (settings->preview_frames > 0 || settings->preview_seconds > 0.f)) {
+    preview_writer = std::make_unique<cg::utils::preview_writer>(settings->preview_path);
+    raytracer->set_preview_interval(settings->preview_frames, settings->preview_seconds);
+    raytracer->preview_callback = [this](std::vector<float3> &&image) {
+      preview_writer->publish(std::move(image), settings->width, settings->height);
+    };
+  }
+
+  for (const auto& name : settings->aovs) {
+    if (name.empty())
+      continue;
+    if (name == "depth")
+      depth_aov = raytracer->add_aov(name);
+    else if (name == "normal")
+      normal_aov = raytracer->add_aov(name);
+    else if (name == "albedo")
+      albedo_aov = raytracer->add_aov(name);
+    else if (name == "shape_id")
+      shape_id_aov = raytracer->add_aov(name, aov_filter::last);
+    else if (name == "hit_count")
+      hit_count_aov = raytracer->add_aov(name, aov_filter::sum);
+    else
+      THROW_ERROR("Unknown AOV: " + name);
+  }
+}
+
+// Any change to the model, the material libraries it references or the
+// builder invalidates the cached BVH
+uint64_t cg::renderer::ray_tracing_renderer::hash_scene_files() const
+{
+  uint64_t key = cg::utils::hash_file(settings->model_path);
+
+  // mtllib statements may list several files, relative to the model
+  std::ifstream model_file(settings->model_path);
+  std::string line;
+  while (std::getline(model_file, line)) {
+    std::istringstream tokens(line);
+    std::string keyword;
+    if (!(tokens >> keyword) || keyword != "mtllib")
+      continue;
+    std::string library;
+    while (tokens >> library)
+      key = cg::utils::hash_file(settings->model_path.parent_path() / library, key);
+  }
+
+  return cg::utils::hash_bytes(
+      settings->bvh_builder.data(), settings->bvh_builder.size(), key);
 }
 
 void cg::renderer::ray_tracing_renderer::init_model()
 {
+  if (!settings->bvh_cache_dir.empty()) {
+    acceleration_structure_key = hash_scene_files();
+
+    std::ostringstream cache_name;
+    cache_name << settings->model_path.stem().string() << "-" << std::hex
+               << std::setw(16) << std::setfill('0')
+               << acceleration_structure_key << ".bvh";
+    acceleration_structure_cache = settings->bvh_cache_dir / cache_name.str();
+
+    // The cached BVH carries its own triangles, so the OBJ isn't parsed at all
+    acceleration_structure_cached = raytracer->load_acceleration_structure(
+        acceleration_structure_cache, acceleration_structure_key);
+    if (acceleration_structure_cached)
+      return;
+  }
+
   model = std::make_shared<cg::world::model>();
   model->load_obj(settings->model_path);
 
   raytracer->set_vertex_buffers(model->get_vertex_buffers());
   raytracer->set_index_buffers(model->get_index_buffers());
-  
-  shadow_raytracer->set_vertex_buffers(model->get_vertex_buffers());
-  shadow_raytracer->set_index_buffers(model->get_index_buffers());
+}
+
+// A checkpoint only continues the render it came from: the key covers the
+// scene files and every setting that changes the image
+void cg::renderer::ray_tracing_renderer::init_checkpoint()
+{
+  if (settings->checkpoint_path.empty()) {
+    if (settings->resume)
+      THROW_ERROR("Resuming needs a checkpoint_path");
+    return;
+  }
+
+  std::ostringstream description;
+  description << std::hexfloat << settings->width << " " << settings->height;
+  for (float coordinate : settings->camera_position)
+    description << " " << coordinate;
+  description << " " << settings->camera_theta << " " << settings->camera_phi << " "
+              << settings->camera_angle_of_view << " " << settings->raytracing_depth << " "
+              << settings->roulette_depth << " " << settings->accumulation_num << " "
+              << settings->adaptive_noise << " " << settings->sample_budget << " "
+              << settings->integrator << " " << settings->sampler;
+  for (const auto& name : settings->aovs)
+    description << " " << name;
+
+  const std::string text = description.str();
+  const uint64_t scene_key = acceleration_structure_key != 0 ? acceleration_structure_key
+                                                             : hash_scene_files();
+  raytracer->set_checkpoint(settings->checkpoint_path,
+                            cg::utils::hash_bytes(text.data(), text.size(), scene_key),
+                            settings->checkpoint_frames, settings->checkpoint_seconds);
+  raytracer->set_resume(settings->resume);
 }
 
 void cg::renderer::ray_tracing_renderer::init_camera()
@@ -51,17 +181,11 @@ void cg::renderer::ray_tracing_renderer::init_lights()
   lights.push_back({float3{0.f, 1.58f, -0.03f}, float3{0.78f, 0.78f, 0.78f}});
 }
 
-void cg::renderer::ray_tracing_renderer::init_shadow_raytracer()
-{
-  shadow_raytracer = std::make_shared<
-      cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
-}
-
 void cg::renderer::ray_tracing_renderer::init()
 {
   init_raytracer();
-  init_shadow_raytracer();
   init_model();
+  init_checkpoint();
   init_camera();
   init_lights();
 }
@@ -69,21 +193,6 @@ void cg::renderer::ray_tracing_renderer::init()
 void cg::renderer::ray_tracing_renderer::destroy() {}
 
 void cg::renderer::ray_tracing_renderer::update() {}
-void cg::renderer::ray_tracing_renderer::setup_shadow_raytracer()
-{
-    shadow_raytracer->miss_shader = [](const ray &ray) {
-        payload payload{};
-        payload.t = -1.f;
-        return payload;
-    };
-
-    shadow_raytracer->any_hit_shader = [](const ray &ray, payload &payload,
-                                      const triangle<cg::vertex> &triangle) {
-        return payload;
-    };
-    shadow_raytracer->build_acceleration_structure();
-}
-
 void cg::renderer::ray_tracing_renderer::setup_main_raytracer()
 {
     raytracer->clear_render_target({0, 0, 0});
@@ -93,22 +202,36 @@ void cg::renderer::ray_tracing_renderer::setup_main_raytracer()
         return payload;
     };
     
-    raytracer->acceleration_structures = shadow_raytracer->acceleration_structures;
+    // A cached structure was already loaded by init_model
+    if (!acceleration_structure_cached) {
+        raytracer->build_acceleration_structure();
+        if (!acceleration_structure_cache.empty())
+            raytracer->save_acceleration_structure(
+                acceleration_structure_cache, acceleration_structure_key);
+    }
+    raytracer->set_lights(lights);
 }
 
-std::tuple<std::mt19937, std::uniform_real_distribution<float>> 
-cg::renderer::ray_tracing_renderer::create_random_generator()
+void cg::renderer::ray_tracing_renderer::validate_acceleration_structure() const
 {
-    std::random_device random_device;
-    std::mt19937 generator(random_device());
-    std::uniform_real_distribution<float> distribution(-1.f, +1.f);
-    
-    return {generator, distribution};
+    auto start = std::chrono::high_resolution_clock::now();
+
+    const size_t kernel_mismatches = raytracer->validate_triangle_kernel(validation_ray_count);
+    std::cout << "Triangle kernel check: " << kernel_mismatches << " of " << validation_ray_count
+              << " rays per bottom level differ from the scalar test\n";
+    const size_t refit_mismatches = raytracer->validate_refit(validation_ray_count);
+    std::cout << "Refit check: " << refit_mismatches << " of " << validation_ray_count
+              << " rays per bottom level differ from a rebuild\n";
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<float, std::milli> duration = stop - start;
+    std::cout << "Validation time: " << duration.count() << "ms\n";
+
+    if (kernel_mismatches > 0 || refit_mismatches > 0)
+        THROW_ERROR("The acceleration structure failed validation");
 }
 
-void cg::renderer::ray_tracing_renderer::setup_closest_hit_shader(
-    std::mt19937& random_generator,
-    std::uniform_real_distribution<float>& uniform_distribution)
+void cg::renderer::ray_tracing_renderer::setup_closest_hit_shader()
 {
     raytracer->closest_hit_shader = [&](const ray &ray, payload &payload,
                                     const triangle<cg::vertex> &triangle,
@@ -119,30 +242,105 @@ void cg::renderer::ray_tracing_renderer::setup_closest_hit_shader(
             payload.bary.y * triangle.nb +
             payload.bary.z * triangle.nc
         );
+        write_aovs(payload, triangle, surface_normal);
 
-        float3 result_color = triangle.emissive;
+        // Past the camera ray, emitters are reached by light sampling only,
+        // so hitting one must not add its emission a second time
+        float3 result_color = payload.random.get_bounce() == 0 ? triangle.emissive : float3{0.f, 0.f, 0.f};
 
-        float3 random_direction{
-            uniform_distribution(random_generator),
-            uniform_distribution(random_generator),
-            uniform_distribution(random_generator),
-        };
-        
-        if (dot(surface_normal, random_direction) < 0.f) {
-            random_direction = -random_direction;
+        light_sample light;
+        if (raytracer->sample_light(hit_position, payload.random, light)) {
+            const float cos_surface = dot(surface_normal, light.direction);
+            if (cos_surface > 0.f &&
+                !raytracer->occluded(cg::renderer::ray(hit_position, light.direction),
+                                     light.distance * shadow_ray_length))
+                result_color += lambert_brdf(triangle.diffuse) * light.radiance * cos_surface;
         }
 
-        cg::renderer::ray next_ray(hit_position, random_direction);
-        auto next_payload = raytracer->trace_ray(next_ray, depth);
+        // Cosine-weighted bounce, weighted by the BRDF times the cosine over
+        // the pdf of the direction
+        const float3 local_direction = sample_cosine_hemisphere(payload.random.next_float2());
+        const float bounce_pdf = cosine_hemisphere_pdf(local_direction.z);
+        if (bounce_pdf > 0.f) {
+            const float3 bounce_weight =
+                lambert_brdf(triangle.diffuse) * local_direction.z / bounce_pdf;
+            cg::renderer::ray next_ray(hit_position,
+                                       orthonormal_basis(surface_normal).to_world(local_direction));
+            auto next_payload = raytracer->trace_ray(next_ray, depth, payload.random.next_bounce(),
+                                                     payload.throughput * bounce_weight);
 
-        result_color += triangle.diffuse * next_payload.color.to_float3() *
-                      std::max(dot(surface_normal, next_ray.direction), 0.f);
+            result_color += bounce_weight * next_payload.color.to_float3();
+        }
                       
         payload.color = cg::color::from_float3(result_color);
         return payload;
     };
 }
 
+void cg::renderer::ray_tracing_renderer::setup_scatter_shader()
+{
+    raytracer->scatter_shader = [&](const ray &ray, payload &payload,
+                                    const triangle<cg::vertex> &triangle,
+                                    size_t /*depth*/) {
+        float3 hit_position = ray.position + ray.direction * payload.t;
+        float3 surface_normal = normalize(
+            payload.bary.x * triangle.na + 
+            payload.bary.y * triangle.nb +
+            payload.bary.z * triangle.nc
+        );
+        write_aovs(payload, triangle, surface_normal);
+
+        scatter_result result;
+        if (payload.random.get_bounce() == 0)
+            result.emitted = triangle.emissive;
+
+        light_sample light;
+        if (raytracer->sample_light(hit_position, payload.random, light)) {
+            const float cos_surface = dot(surface_normal, light.direction);
+            if (cos_surface > 0.f) {
+                result.connect = true;
+                result.shadow_ray = cg::renderer::ray(hit_position, light.direction);
+                result.shadow_max_t = light.distance * shadow_ray_length;
+                result.shadow_radiance = lambert_brdf(triangle.diffuse) * light.radiance * cos_surface;
+            }
+        }
+
+        // Cosine-weighted, like the recursive closest hit shader
+        const float3 local_direction = sample_cosine_hemisphere(payload.random.next_float2());
+        const float bounce_pdf = cosine_hemisphere_pdf(local_direction.z);
+        if (bounce_pdf > 0.f) {
+            result.scattered = true;
+            result.next_ray = cg::renderer::ray(
+                hit_position, orthonormal_basis(surface_normal).to_world(local_direction));
+            result.attenuation = lambert_brdf(triangle.diffuse) * local_direction.z / bounce_pdf;
+        }
+        return result;
+    };
+}
+
+// Surface channels describe the camera ray's hit, the hit count sums every
+// bounce of the path
+void cg::renderer::ray_tracing_renderer::write_aovs(payload &payload,
+                                                    const triangle<cg::vertex> &triangle,
+                                                    float3 surface_normal)
+{
+    if (hit_count_aov != no_aov)
+        raytracer->write_aov(hit_count_aov, payload, float3{1.f, 1.f, 1.f});
+    if (payload.random.get_bounce() != 0)
+        return;
+
+    if (depth_aov != no_aov)
+        raytracer->write_aov(depth_aov, payload, float3{payload.t, payload.t, payload.t});
+    if (normal_aov != no_aov)
+        raytracer->write_aov(normal_aov, payload, surface_normal);
+    if (albedo_aov != no_aov)
+        raytracer->write_aov(albedo_aov, payload, triangle.diffuse);
+    if (shape_id_aov != no_aov) {
+        const float shape_id = static_cast<float>(triangle.shape_id);
+        raytracer->write_aov(shape_id_aov, payload, float3{shape_id, shape_id, shape_id});
+    }
+}
+
 void cg::renderer::ray_tracing_renderer::trace_rays_and_save()
 {
     auto start = std::chrono::high_resolution_clock::now();
@@ -160,16 +358,59 @@ void cg::renderer::ray_tracing_renderer::trace_rays_and_save()
     std::chrono::duration<float, std::milli> duration = stop - start;
     std::cout << "Raytracing time: " << duration.count() << "ms\n";
 
-    cg::utils::save_resource(*render_target, settings->result_path);
+    // Lets the last preview finish before the result is written
+    preview_writer.reset();
+
+    const auto& tile_timings = raytracer->get_tile_timings();
+    if (!tile_timings.empty()) {
+        float total_time = 0.f;
+        auto slowest = tile_timings.begin();
+        for (auto tile = tile_timings.begin(); tile != tile_timings.end(); tile++) {
+            total_time += tile->milliseconds;
+            if (tile->milliseconds > slowest->milliseconds)
+                slowest = tile;
+        }
+        std::cout << "Tiles: " << tile_timings.size() << ", mean "
+                  << total_time / tile_timings.size() << "ms, slowest "
+                  << slowest->milliseconds << "ms at (" << slowest->x << ", "
+                  << slowest->y << ")\n";
+    }
+
+    auto save_start = std::chrono::high_resolution_clock::now();
+
+    const auto extension = settings->result_path.extension();
+    const bool float_result = extension == ".pfm" || extension == ".exr";
+    if (float_result) {
+        cg::utils::save_resource(*render_target, settings->result_path);
+    }
+    else {
+        cg::resource<cg::unsigned_color> image(settings->width, settings->height);
+        for (size_t i = 0; i < image.get_number_of_elements(); i++)
+            image.item(i) = cg::unsigned_color::from_linear(render_target->item(i).to_float3());
+        cg::utils::save_resource(image, settings->result_path);
+    }
+
+    // <result>.<name>.pfm for every output variable, .exr next to an EXR result
+    for (unsigned aov_id = 0; aov_id < raytracer->get_aov_count(); aov_id++) {
+        const auto& output = raytracer->get_aov(aov_id);
+        std::filesystem::path aov_path = settings->result_path;
+        aov_path.replace_extension(output.name + (extension == ".exr" ? ".exr" : ".pfm"));
+        cg::utils::save_resource(*output.buffer, aov_path);
+    }
+
+    auto save_stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<float, std::milli> save_duration = save_stop - save_start;
+    std::cout << "Saving time: " << save_duration.count() << "ms\n";
 }
 
 void cg::renderer::ray_tracing_renderer::render()
 {
-    setup_shadow_raytracer();
     setup_main_raytracer();
+    if (settings->validate)
+        validate_acceleration_structure();
     
-    auto [random_generator, uniform_distribution] = create_random_generator();
-    setup_closest_hit_shader(random_generator, uniform_distribution);
+    setup_closest_hit_shader();
+    setup_scatter_shader();
     
     trace_rays_and_save();
 }
\ No newline at end of file
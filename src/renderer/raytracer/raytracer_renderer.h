@@ -1,6 +1,9 @@
 #include "renderer/raytracer/raytracer.h"
 #include "renderer/renderer.h"
 #include "resource.h"
+#include "utils/preview_writer.h"
+
+#include <limits>
 
 
 namespace cg::renderer
@@ -15,24 +18,49 @@ namespace cg::renderer
 		virtual void render();
 
 	protected:
-		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
+		// Kept in float, .pfm and .exr results are saved without clamping or
+		// quantization, anything else goes through 8-bit PNG
+		std::shared_ptr<cg::resource<cg::float_color>> render_target;
 
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> raytracer;
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
+		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::float_color>> raytracer;
 
 		std::vector<cg::renderer::light> lights;
 
+		// Writes the previews ray_generation publishes while it keeps tracing
+		std::unique_ptr<cg::utils::preview_writer> preview_writer;
+
+		std::filesystem::path acceleration_structure_cache;
+		uint64_t acceleration_structure_key = 0;
+		bool acceleration_structure_cached = false;
+
+		// Ids of the output variables asked for with --aovs, no_aov for the rest
+		static constexpr unsigned no_aov = std::numeric_limits<unsigned>::max();
+		unsigned depth_aov = no_aov;
+		unsigned normal_aov = no_aov;
+		unsigned albedo_aov = no_aov;
+		unsigned shape_id_aov = no_aov;
+		unsigned hit_count_aov = no_aov;
+
 	private:
 		void init_raytracer();
 		void init_model();
+		uint64_t hash_scene_files() const;
+		void init_checkpoint();
 		void init_camera();
 		void init_lights();
-		void init_shadow_raytracer();
-		void setup_shadow_raytracer();
 		void setup_main_raytracer();
-		std::tuple<std::mt19937, std::uniform_real_distribution<float>> create_random_generator();
-		void setup_closest_hit_shader(std::mt19937& random_generator, 
-								   std::uniform_real_distribution<float>& uniform_distribution);
+		// --validate: rays that disagree with the reference fail the render
+		void validate_acceleration_structure() const;
+		static constexpr size_t validation_ray_count = 100000;
+		// Shaders draw their random numbers from the sampler in the payload
+		void setup_closest_hit_shader();
+		void setup_scatter_shader();
+		// Called by both shaders at every hit
+		void write_aovs(payload& payload, const triangle<cg::vertex>& triangle,
+						float3 surface_normal);
+		// Shadow rays stop short of the sampled light point so the emitter
+		// itself doesn't occlude it
+		static constexpr float shadow_ray_length = 0.999f;
 		void trace_rays_and_save();
 	};
 }// namespace cg::renderer
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include "sampler.h"
+
+#include <cmath>
+#include <vector>
+
+
+namespace
+{
+	constexpr uint32_t mask_size = cg::renderer::sampler::blue_noise_size;
+	constexpr uint32_t mask_pixels = mask_size * mask_size;
+
+	// Gaussian-filtered point density on the torus, updated as points come and go
+	class void_and_cluster
+	{
+	public:
+		void_and_cluster() : kernel(mask_pixels), energy(mask_pixels, 0.f), points(mask_pixels, false)
+		{
+			constexpr float sigma = 1.5f;
+			for (uint32_t y = 0; y < mask_size; y++) {
+				for (uint32_t x = 0; x < mask_size; x++) {
+					const float dx = static_cast<float>(std::min(x, mask_size - x));
+					const float dy = static_cast<float>(std::min(y, mask_size - y));
+					kernel[y * mask_size + x] = std::exp(-(dx * dx + dy * dy) / (2.f * sigma * sigma));
+				}
+			}
+		}
+
+		void toggle(uint32_t pixel)
+		{
+			points[pixel] = !points[pixel];
+			const float sign = points[pixel] ? 1.f : -1.f;
+			const uint32_t pixel_x = pixel % mask_size;
+			const uint32_t pixel_y = pixel / mask_size;
+			for (uint32_t y = 0; y < mask_size; y++) {
+				const uint32_t kernel_row = ((y - pixel_y) % mask_size) * mask_size;
+				for (uint32_t x = 0; x < mask_size; x++)
+					energy[y * mask_size + x] += sign * kernel[kernel_row + (x - pixel_x) % mask_size];
+			}
+		}
+
+		// Densest point, or the emptiest spot without one
+		uint32_t find(bool tightest_cluster) const
+		{
+			uint32_t best = mask_pixels;
+			for (uint32_t pixel = 0; pixel < mask_pixels; pixel++) {
+				if (points[pixel] != tightest_cluster)
+					continue;
+				if (best == mask_pixels ||
+					(tightest_cluster ? energy[pixel] > energy[best] : energy[pixel] < energy[best]))
+					best = pixel;
+			}
+			return best;
+		}
+
+		bool has_point(uint32_t pixel) const
+		{
+			return points[pixel];
+		}
+
+	protected:
+		std::vector<float> kernel;
+		std::vector<float> energy;
+		std::vector<bool> points;
+	};
+
+	std::array<float, mask_pixels> generate_blue_noise_mask()
+	{
+		// Initial pattern: a tenth of the pixels, spread out by moving the
+		// tightest cluster into the largest void until that changes nothing
+		void_and_cluster initial;
+		uint32_t initial_count = 0;
+		for (uint32_t candidate = 0; initial_count < mask_pixels / 10; candidate++) {
+			const uint32_t pixel = (candidate * 2654435761u >> 7) % mask_pixels;
+			if (!initial.has_point(pixel)) {
+				initial.toggle(pixel);
+				initial_count++;
+			}
+		}
+		for (uint32_t iteration = 0; iteration < mask_pixels; iteration++) {
+			const uint32_t cluster = initial.find(true);
+			initial.toggle(cluster);
+			const uint32_t void_pixel = initial.find(false);
+			initial.toggle(void_pixel);
+			if (void_pixel == cluster)
+				break;
+		}
+
+		std::array<uint32_t, mask_pixels> ranks{};
+
+		// The initial points are ranked by taking the tightest cluster away
+		void_and_cluster removing = initial;
+		for (uint32_t rank = initial_count; rank-- > 0;) {
+			const uint32_t cluster = removing.find(true);
+			ranks[cluster] = rank;
+			removing.toggle(cluster);
+		}
+
+		// The rest by filling the largest void. Past half the pixels this is
+		// still the original third phase, since the emptiest spot is where the
+		// unfilled pixels cluster most
+		void_and_cluster adding = initial;
+		for (uint32_t rank = initial_count; rank < mask_pixels; rank++) {
+			const uint32_t void_pixel = adding.find(false);
+			ranks[void_pixel] = rank;
+			adding.toggle(void_pixel);
+		}
+
+		std::array<float, mask_pixels> mask{};
+		for (uint32_t pixel = 0; pixel < mask_pixels; pixel++)
+			mask[pixel] = (static_cast<float>(ranks[pixel]) + 0.5f) / static_cast<float>(mask_pixels);
+		return mask;
+	}
+}// namespace
+
+const std::array<float, cg::renderer::sampler::blue_noise_size * cg::renderer::sampler::blue_noise_size>&
+cg::renderer::sampler::get_blue_noise_mask()
+{
+	// Built on first use, which takes about a tenth of a second
+	static const std::array<float, mask_pixels> mask = generate_blue_noise_mask();
+	return mask;
+}
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <linalg.h>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	enum class sampler_type : uint8_t
+	{
+		// Independent pcg4d hashes
+		random,
+		// Sobol points with Owen scrambling and a per-pixel shuffle (Burley 2020)
+		sobol,
+		// Extensible base-2 rank-1 lattice with a random shift per pixel
+		lattice,
+		// Halton points rotated per pixel by a blue-noise dither mask
+		halton
+	};
+
+	// Counter-based random numbers: every draw depends only on the pixel, the
+	// sample index, the bounce and a per-bounce dimension counter. No state is
+	// shared between threads and reruns draw the same numbers.
+	//
+	// The low-discrepancy types hand out dimensions in groups of four. Each
+	// group of each bounce draws its point at its own shuffle of the sample
+	// index, so the groups pad one another with independent 4D points.
+	//
+	// Sequences plug in as a sampler_type value and a sample_* member picked
+	// in next_float, rather than behind a virtual interface: samplers are
+	// small values copied into every path and bounce, and a draw stays a
+	// direct call.
+	class sampler
+	{
+	public:
+		sampler() = default;
+		sampler(uint32_t pixel_id, uint32_t sample_id, uint32_t bounce = 0);
+		// The pixel coordinates place the pixel in the blue-noise mask
+		sampler(uint32_t pixel_x, uint32_t pixel_y, uint32_t width, uint32_t sample_id,
+				sampler_type type);
+
+		// Uniform in [0, 1)
+		float next_float();
+		float2 next_float2();
+		// Generator of the same path one bounce deeper
+		sampler next_bounce() const;
+
+		// Samplers made without a pixel, such as the one of the plain
+		// trace_ray overload, report no_pixel
+		uint32_t get_pixel_id() const;
+		bool has_pixel() const;
+
+		static constexpr uint32_t no_pixel = 0xffffffffu;
+		uint32_t get_sample_id() const;
+		uint32_t get_bounce() const;
+		sampler_type get_type() const;
+
+		static constexpr uint32_t blue_noise_size = 64;
+		// Void-and-cluster dither mask (Ulichney 1993), ranks scaled into [0, 1)
+		static const std::array<float, blue_noise_size * blue_noise_size>& get_blue_noise_mask();
+
+	protected:
+		uint32_t sample_sobol(uint32_t group_seed, uint32_t lane) const;
+		uint32_t sample_lattice(uint32_t group_seed, uint32_t lane) const;
+		uint32_t sample_halton(uint32_t group, uint32_t lane) const;
+
+		static void pcg4d(uint32_t& x, uint32_t& y, uint32_t& z, uint32_t& w);
+		static uint32_t hash(uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+		static uint32_t reverse_bits(uint32_t value);
+		static uint32_t nested_uniform_scramble(uint32_t value, uint32_t seed);
+
+		static constexpr uint32_t group_size = 4;
+
+		uint32_t pixel_id = no_pixel;
+		uint32_t sample_id = 0;
+		uint32_t bounce = 0;
+		uint32_t dimension = 0;
+		// Pixel position in the blue-noise mask
+		uint16_t dither_index = 0;
+		sampler_type type = sampler_type::random;
+	};
+
+	// Direction numbers of the first four Sobol dimensions, from the primitive
+	// polynomials and initial numbers of Joe and Kuo (2008)
+	inline constexpr std::array<std::array<uint32_t, 32>, 4> sobol_directions = [] {
+		constexpr uint32_t degrees[4] = {0, 1, 2, 3};
+		constexpr uint32_t coefficients[4] = {0, 0, 1, 1};
+		constexpr uint32_t initial[4][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+
+		std::array<std::array<uint32_t, 32>, 4> directions{};
+		for (uint32_t bit = 0; bit < 32; bit++)
+			directions[0][bit] = 1u << (31 - bit);
+		for (uint32_t dim = 1; dim < 4; dim++) {
+			const uint32_t s = degrees[dim];
+			auto& v = directions[dim];
+			for (uint32_t bit = 0; bit < 32; bit++) {
+				if (bit < s) {
+					v[bit] = initial[dim][bit] << (31 - bit);
+					continue;
+				}
+				v[bit] = v[bit - s] ^ (v[bit - s] >> s);
+				for (uint32_t k = 1; k < s; k++)
+					v[bit] ^= ((coefficients[dim] >> (s - 1 - k)) & 1u) * v[bit - k];
+			}
+		}
+		return directions;
+	}();
+
+	// Odd generator of an extensible rank-1 lattice per dimension of a group
+	inline constexpr uint32_t lattice_generators[4] = {1u, 182667u, 469891u, 498753u};
+
+	inline constexpr uint32_t halton_bases[4] = {2u, 3u, 5u, 7u};
+
+	inline sampler::sampler(uint32_t pixel_id, uint32_t sample_id, uint32_t bounce)
+		: pixel_id(pixel_id), sample_id(sample_id), bounce(bounce)
+	{
+	}
+
+	inline sampler::sampler(uint32_t pixel_x, uint32_t pixel_y, uint32_t width,
+							uint32_t sample_id, sampler_type type)
+		: pixel_id(pixel_y * width + pixel_x), sample_id(sample_id),
+		  dither_index(static_cast<uint16_t>((pixel_y % blue_noise_size) * blue_noise_size +
+											 pixel_x % blue_noise_size)),
+		  type(type)
+	{
+	}
+
+	inline float sampler::next_float()
+	{
+		const uint32_t current = dimension++;
+		const uint32_t group = current / group_size;
+		const uint32_t lane = current % group_size;
+
+		uint32_t bits;
+		switch (type) {
+			case sampler_type::sobol:
+				bits = sample_sobol(hash(pixel_id, bounce, group, 0x5bd1e995u), lane);
+				break;
+			case sampler_type::lattice:
+				bits = sample_lattice(hash(pixel_id, bounce, group, 0x27d4eb2fu), lane);
+				break;
+			case sampler_type::halton:
+				bits = sample_halton(group, lane);
+				break;
+			default:
+				bits = hash(pixel_id, sample_id, bounce, current);
+				break;
+		}
+		// The upper 24 bits fill the float mantissa exactly
+		return static_cast<float>(bits >> 8) * (1.f / 16777216.f);
+	}
+
+	inline float2 sampler::next_float2()
+	{
+		float u = next_float();
+		float v = next_float();
+		return float2{u, v};
+	}
+
+	inline sampler sampler::next_bounce() const
+	{
+		sampler result = *this;
+		result.bounce = bounce + 1;
+		result.dimension = 0;
+		return result;
+	}
+
+	inline uint32_t sampler::get_pixel_id() const
+	{
+		return pixel_id;
+	}
+
+	inline bool sampler::has_pixel() const
+	{
+		return pixel_id != no_pixel;
+	}
+
+	inline uint32_t sampler::get_sample_id() const
+	{
+		return sample_id;
+	}
+
+	inline uint32_t sampler::get_bounce() const
+	{
+		return bounce;
+	}
+
+	inline sampler_type sampler::get_type() const
+	{
+		return type;
+	}
+
+	// The sample index is shuffled and every dimension scrambled with the same
+	// nested uniform permutation, which keeps the point set stratified
+	inline uint32_t sampler::sample_sobol(uint32_t group_seed, uint32_t lane) const
+	{
+		const uint32_t index = nested_uniform_scramble(sample_id, group_seed);
+
+		uint32_t result = 0;
+		for (uint32_t bit = 0, rest = index; rest != 0; bit++, rest >>= 1) {
+			if (rest & 1u)
+				result ^= sobol_directions[lane][bit];
+		}
+		return nested_uniform_scramble(result, hash(group_seed, lane, 0, 0x68e31da4u));
+	}
+
+	// phi(i) * g mod 1 with phi the base-2 radical inverse, which is exact in
+	// 32-bit fixed point, plus a Cranley-Patterson shift. The index is
+	// shuffled like the Sobol one, which keeps every power of two prefix a
+	// full lattice.
+	inline uint32_t sampler::sample_lattice(uint32_t group_seed, uint32_t lane) const
+	{
+		const uint32_t index = nested_uniform_scramble(sample_id, group_seed);
+		return reverse_bits(index) * lattice_generators[lane] +
+			   hash(group_seed, lane, 0, 0xb5297a4du);
+	}
+
+	// The first group of the camera ray walks the sequence in order, later
+	// groups and bounces at a shuffled index. Both the shuffle and the mask
+	// offset depend on the dimension only, so neighbouring pixels keep
+	// blue-noise rotations in every dimension.
+	inline uint32_t sampler::sample_halton(uint32_t group, uint32_t lane) const
+	{
+		const uint32_t first_index =
+				bounce == 0 && group == 0
+						? sample_id
+						: nested_uniform_scramble(sample_id, hash(bounce, group, 0, 0x85ebca6bu));
+		const uint32_t base = halton_bases[lane];
+		double inverse_base = 1.0 / base;
+		double fraction = inverse_base;
+		double value = 0.0;
+		for (uint32_t index = first_index; index > 0; index /= base) {
+			value += (index % base) * fraction;
+			fraction *= inverse_base;
+		}
+
+		const uint32_t offset = hash(bounce, group, lane, 0x1b873593u);
+		const uint32_t mask_x = (dither_index + offset) % blue_noise_size;
+		const uint32_t mask_y = (dither_index / blue_noise_size + (offset >> 16)) % blue_noise_size;
+		const float rotation = get_blue_noise_mask()[mask_y * blue_noise_size + mask_x];
+
+		value += rotation;
+		value -= static_cast<uint32_t>(value);
+		return static_cast<uint32_t>(value * 4294967296.0);
+	}
+
+	inline void sampler::pcg4d(uint32_t& x, uint32_t& y, uint32_t& z, uint32_t& w)
+	{
+		x = x * 1664525u + 1013904223u;
+		y = y * 1664525u + 1013904223u;
+		z = z * 1664525u + 1013904223u;
+		w = w * 1664525u + 1013904223u;
+
+		x += y * w;
+		y += z * x;
+		z += x * y;
+		w += y * z;
+
+		x ^= x >> 16;
+		y ^= y >> 16;
+		z ^= z >> 16;
+		w ^= w >> 16;
+
+		x += y * w;
+		y += z * x;
+		z += x * y;
+		w += y * z;
+	}
+
+	// pcg4d (Jarzynski and Olano 2020) reduced to one output
+	inline uint32_t sampler::hash(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+	{
+		pcg4d(a, b, c, d);
+		return a;
+	}
+
+	inline uint32_t sampler::reverse_bits(uint32_t value)
+	{
+		value = (value << 16) | (value >> 16);
+		value = ((value & 0x00ff00ffu) << 8) | ((value & 0xff00ff00u) >> 8);
+		value = ((value & 0x0f0f0f0fu) << 4) | ((value & 0xf0f0f0f0u) >> 4);
+		value = ((value & 0x33333333u) << 2) | ((value & 0xccccccccu) >> 2);
+		value = ((value & 0x55555555u) << 1) | ((value & 0xaaaaaaaau) >> 1);
+		return value;
+	}
+
+	// Owen scrambling through the Laine-Karras permutation on reversed bits,
+	// with the constants of Burley's improved hash
+	inline uint32_t sampler::nested_uniform_scramble(uint32_t value, uint32_t seed)
+	{
+		value = reverse_bits(value);
+		value += seed;
+		value ^= value * 0x6c50b47cu;
+		value ^= value * 0xb82f1e52u;
+		value ^= value * 0xc7afe638u;
+		value ^= value * 0x8d22f6e6u;
+		return reverse_bits(value);
+	}
+}// namespace cg::renderer
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <linalg.h>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	constexpr float pi = 3.14159265358979f;
+
+	// Tangent frame around a unit normal, built without branches on the
+	// normal's direction (Duff et al. 2017)
+	struct orthonormal_basis
+	{
+		explicit orthonormal_basis(float3 in_normal);
+
+		// Maps a direction given with z along the normal to world space
+		float3 to_world(float3 local) const;
+
+		float3 tangent;
+		float3 bitangent;
+		float3 normal;
+	};
+
+	inline orthonormal_basis::orthonormal_basis(float3 in_normal) : normal(in_normal)
+	{
+		const float sign = std::copysign(1.f, normal.z);
+		const float a = -1.f / (sign + normal.z);
+		const float b = normal.x * normal.y * a;
+		tangent = float3{1.f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x};
+		bitangent = float3{b, sign + normal.y * normal.y * a, -normal.y};
+	}
+
+	inline float3 orthonormal_basis::to_world(float3 local) const
+	{
+		return local.x * tangent + local.y * bitangent + local.z * normal;
+	}
+
+	// Directions around +z from two uniform numbers in [0, 1). Malley's
+	// method: a uniform point on the unit disk projected up to the hemisphere
+	inline float3 sample_cosine_hemisphere(float2 u)
+	{
+		const float radius = std::sqrt(u.x);
+		const float phi = 2.f * pi * u.y;
+		return float3{radius * std::cos(phi), radius * std::sin(phi),
+					  std::sqrt(std::max(0.f, 1.f - u.x))};
+	}
+
+	inline float cosine_hemisphere_pdf(float cos_theta)
+	{
+		return std::max(cos_theta, 0.f) / pi;
+	}
+
+	// Lambertian reflection of the given albedo
+	inline float3 lambert_brdf(float3 diffuse)
+	{
+		return diffuse / pi;
+	}
+}// namespace cg::renderer
@@ -115,6 +115,11 @@ namespace cg
 					static_cast<uint8_t>(clamped.z),
 			};
 		};
+		// Encodes linear radiance with a gamma of 2
+		static unsigned_color from_linear(const float3& color)
+		{
+			return from_float3(sqrt(max(color, 0.f)));
+		};
 		float3 to_float3() const
 		{
 			return float3{
@@ -128,6 +133,31 @@ namespace cg
 		uint8_t b;
 	};
 
+	// Unclamped float pixel, for HDR output that is tone mapped downstream
+	struct float_color
+	{
+		static float_color from_color(const color& color)
+		{
+			return float_color{color.r, color.g, color.b};
+		};
+		static float_color from_float3(const float3& color)
+		{
+			return float_color{color.x, color.y, color.z};
+		};
+		// Keeps linear radiance as it is
+		static float_color from_linear(const float3& color)
+		{
+			return from_float3(color);
+		};
+		float3 to_float3() const
+		{
+			return float3{r, g, b};
+		};
+		float r;
+		float g;
+		float b;
+	};
+
 
 	struct vertex
 	{
@@ -22,9 +22,26 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("camera_angle_of_view", "Camera angle of view", cxxopts::value<float>()->default_value("60.0"));
 	add_options("camera_z_near", "Minimum expected depth", cxxopts::value<float>()->default_value("0.001"));
 	add_options("camera_z_far", "Maximum expected depth", cxxopts::value<float>()->default_value("100.0"));
-	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
+	add_options("result_path", "Path to resulted image: .png, or .pfm and .exr for float output", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
+	add_options("aovs", "Output variables saved as float images next to the result: depth, normal, albedo, shape_id, hit_count", cxxopts::value<std::vector<std::string>>()->default_value(""));
+	add_options("preview_path", "Path to a PNG preview updated during accumulation, empty to disable", cxxopts::value<std::filesystem::path>()->default_value(""));
+	add_options("preview_frames", "Frames between previews, 0 to disable", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("preview_seconds", "Seconds between previews, 0 to disable", cxxopts::value<float>()->default_value("0.0"));
+	add_options("checkpoint_path", "Path to the accumulation checkpoint, empty to disable", cxxopts::value<std::filesystem::path>()->default_value(""));
+	add_options("checkpoint_frames", "Frames between checkpoints, 0 to disable", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("checkpoint_seconds", "Seconds between checkpoints, 0 to disable", cxxopts::value<float>()->default_value("0.0"));
+	add_options("resume", "Continue the render from the checkpoint", cxxopts::value<bool>()->default_value("false"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("roulette_depth", "Bounces before Russian roulette may end a path, 0 to disable", cxxopts::value<unsigned>()->default_value("0"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("adaptive_noise", "Relative error at which a pixel stops sampling, 0 to disable", cxxopts::value<float>()->default_value("0.0"));
+	add_options("sample_budget", "Average samples per pixel for adaptive sampling, 0 to disable", cxxopts::value<float>()->default_value("0.0"));
+	add_options("denoise_iterations", "A-trous denoiser iterations, 0 to disable", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("bvh_builder", "BVH builder: sah, lbvh or sbvh", cxxopts::value<std::string>()->default_value("sah"));
+	add_options("integrator", "Path integrator: recursive or wavefront", cxxopts::value<std::string>()->default_value("recursive"));
+	add_options("sampler", "Sample sequence: random, sobol, lattice or halton", cxxopts::value<std::string>()->default_value("random"));
+	add_options("bvh_cache_dir", "Directory for cached acceleration structures, empty to disable", cxxopts::value<std::filesystem::path>()->default_value(""));
+	add_options("validate", "Check the acceleration structure against reference results before rendering", cxxopts::value<bool>()->default_value("false"));
 	add_options("shader_path", "Path to a shader file", cxxopts::value<std::filesystem::path>()->default_value("shaders/shaders.hlsl"));
 	add_options("h,help", "Print usage");
 
@@ -45,8 +62,25 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->camera_z_near = result["camera_z_near"].as<float>();
 	settings->camera_z_far = result["camera_z_far"].as<float>();
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
+	settings->aovs = result["aovs"].as<std::vector<std::string>>();
+	settings->preview_path = result["preview_path"].as<std::filesystem::path>();
+	settings->preview_frames = result["preview_frames"].as<unsigned>();
+	settings->preview_seconds = result["preview_seconds"].as<float>();
+	settings->checkpoint_path = result["checkpoint_path"].as<std::filesystem::path>();
+	settings->checkpoint_frames = result["checkpoint_frames"].as<unsigned>();
+	settings->checkpoint_seconds = result["checkpoint_seconds"].as<float>();
+	settings->resume = result["resume"].as<bool>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
+	settings->roulette_depth = result["roulette_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->denoise_iterations = result["denoise_iterations"].as<unsigned>();
+	settings->bvh_builder = result["bvh_builder"].as<std::string>();
+	settings->adaptive_noise = result["adaptive_noise"].as<float>();
+	settings->sample_budget = result["sample_budget"].as<float>();
+	settings->integrator = result["integrator"].as<std::string>();
+	settings->sampler = result["sampler"].as<std::string>();
+	settings->bvh_cache_dir = result["bvh_cache_dir"].as<std::filesystem::path>();
+	settings->validate = result["validate"].as<bool>();
 	settings->shader_path = result["shader_path"].as<std::filesystem::path>();
 
 	return settings;
@@ -24,9 +24,26 @@ namespace cg
 		float camera_z_far;
 
 		std::filesystem::path result_path;
+		std::vector<std::string> aovs;
+		std::filesystem::path preview_path;
+		unsigned preview_frames;
+		float preview_seconds;
+		std::filesystem::path checkpoint_path;
+		unsigned checkpoint_frames;
+		float checkpoint_seconds;
+		bool resume;
 
 		unsigned raytracing_depth;
+		unsigned roulette_depth;
 		unsigned accumulation_num;
+		float adaptive_noise;
+		float sample_budget;
+		unsigned denoise_iterations;
+		std::string bvh_builder;
+		std::string integrator;
+		std::string sampler;
+		std::filesystem::path bvh_cache_dir;
+		bool validate;
 
 		std::filesystem::path shader_path;
 	};
@@ -0,0 +1,113 @@
+#include "file_utils.h"
+
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+uint64_t cg::utils::hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+	const auto* bytes = static_cast<const unsigned char*>(data);
+	uint64_t hash = seed;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+uint64_t cg::utils::hash_file(const std::filesystem::path& filepath, uint64_t seed)
+{
+	std::ifstream file(filepath, std::ios::binary);
+	std::vector<char> buffer(1 << 20);
+	uint64_t hash = seed;
+	while (file) {
+		file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+		hash = hash_bytes(buffer.data(), static_cast<size_t>(file.gcount()), hash);
+	}
+	return hash;
+}
+
+cg::utils::mapped_file::mapped_file(const std::filesystem::path& filepath)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileW(filepath.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+							  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	file_handle = file;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		return;
+
+	mapping_handle = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping_handle)
+		return;
+
+	data = static_cast<const char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+	if (data)
+		size = static_cast<size_t>(file_size.QuadPart);
+#else
+	file_descriptor = open(filepath.c_str(), O_RDONLY);
+	if (file_descriptor < 0)
+		return;
+
+	struct stat file_stat;
+	if (fstat(file_descriptor, &file_stat) != 0 || file_stat.st_size == 0)
+		return;
+
+	void* mapping = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+	if (mapping == MAP_FAILED)
+		return;
+
+	data = static_cast<const char*>(mapping);
+	size = static_cast<size_t>(file_stat.st_size);
+#endif
+}
+
+cg::utils::mapped_file::~mapped_file()
+{
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle)
+		CloseHandle(file_handle);
+#else
+	if (data)
+		munmap(const_cast<char*>(data), size);
+	if (file_descriptor >= 0)
+		close(file_descriptor);
+#endif
+}
+
+bool cg::utils::mapped_file::is_open() const
+{
+	return data != nullptr;
+}
+
+const char* cg::utils::mapped_file::get_data() const
+{
+	return data;
+}
+
+size_t cg::utils::mapped_file::get_size() const
+{
+	return size;
+}
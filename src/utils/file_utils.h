@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+
+namespace cg::utils
+{
+	// FNV-1a hash of the file contents, chained from the seed
+	uint64_t hash_file(const std::filesystem::path& filepath, uint64_t seed = 14695981039346656037ull);
+	uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull);
+
+	// Read-only memory mapping of a whole file
+	class mapped_file
+	{
+	public:
+		explicit mapped_file(const std::filesystem::path& filepath);
+		~mapped_file();
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		bool is_open() const;
+		const char* get_data() const;
+		size_t get_size() const;
+
+	private:
+		const char* data = nullptr;
+		size_t size = 0;
+#ifdef _WIN32
+		void* file_handle = nullptr;
+		void* mapping_handle = nullptr;
+#else
+		int file_descriptor = -1;
+#endif
+	};
+}// namespace cg::utils
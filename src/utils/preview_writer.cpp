@@ -0,0 +1,75 @@
+#include "preview_writer.h"
+
+#include "utils/resource_utils.h"
+
+#include <iostream>
+
+
+cg::utils::preview_writer::preview_writer(std::filesystem::path filepath)
+	: filepath(std::move(filepath)), worker(&preview_writer::run, this)
+{
+}
+
+cg::utils::preview_writer::~preview_writer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	pending_changed.notify_one();
+	worker.join();
+}
+
+void cg::utils::preview_writer::publish(std::vector<float3> image, size_t width, size_t height)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending_image = std::move(image);
+		pending_width = width;
+		pending_height = height;
+		has_pending = true;
+	}
+	pending_changed.notify_one();
+}
+
+void cg::utils::preview_writer::run()
+{
+	std::vector<float3> image;
+	size_t width;
+	size_t height;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			pending_changed.wait(lock, [this] { return has_pending || stopping; });
+			if (!has_pending)
+				return;
+			std::swap(image, pending_image);
+			width = pending_width;
+			height = pending_height;
+			has_pending = false;
+		}
+
+		// Nothing waits for the preview, so a failed write only gets reported
+		try {
+			write(image, width, height);
+		}
+		catch (const std::exception& error) {
+			std::cerr << "Preview: " << error.what() << "\n";
+		}
+	}
+}
+
+// The image goes to a temporary file first and replaces the preview in one
+// rename, so viewers never pick up a half-written file
+void cg::utils::preview_writer::write(const std::vector<float3>& image, size_t width,
+									  size_t height) const
+{
+	cg::resource<cg::unsigned_color> tone_mapped(width, height);
+	for (size_t i = 0; i < image.size(); i++)
+		tone_mapped.item(i) = cg::unsigned_color::from_linear(image[i]);
+
+	std::filesystem::path temporary_path = filepath;
+	temporary_path += ".tmp";
+	cg::utils::save_resource(tone_mapped, temporary_path, false);
+	std::filesystem::rename(temporary_path, filepath);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "resource.h"
+
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace cg::utils
+{
+	// Tone maps and encodes preview images on a thread of its own, so the
+	// renderer hands an image over and goes on tracing. An image published
+	// while the previous one is still being written replaces any image
+	// waiting behind it, only the newest one is worth the encoding time.
+	class preview_writer
+	{
+	public:
+		explicit preview_writer(std::filesystem::path filepath);
+		// Writes the image still waiting, if any, then stops the thread
+		~preview_writer();
+
+		void publish(std::vector<float3> image, size_t width, size_t height);
+
+	private:
+		void run();
+		void write(const std::vector<float3>& image, size_t width, size_t height) const;
+
+		std::filesystem::path filepath;
+
+		std::mutex mutex;
+		std::condition_variable pending_changed;
+		std::vector<float3> pending_image;
+		size_t pending_width = 0;
+		size_t pending_height = 0;
+		bool has_pending = false;
+		bool stopping = false;
+
+		// Declared last, so it starts once everything it reads is initialized
+		std::thread worker;
+	};
+}// namespace cg::utils
@@ -5,7 +5,10 @@
 
 #include "utils/error_handler.h"
 
+#include <cstring>
+#include <fstream>
 #include <stb_image_write.h>
+#include <vector>
 
 
 std::string view_command(const std::filesystem::path& path)
@@ -19,7 +22,149 @@ std::string view_command(const std::filesystem::path& path)
 	return "";
 }
 
-void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, const std::filesystem::path filepath)
+namespace
+{
+	// Both float formats are little-endian, like every host this builds for
+	template<typename T>
+	void append(std::vector<char>& bytes, const T& value)
+	{
+		const size_t offset = bytes.size();
+		bytes.resize(offset + sizeof(T));
+		std::memcpy(bytes.data() + offset, &value, sizeof(T));
+	}
+
+	void append_string(std::vector<char>& bytes, const char* value)
+	{
+		bytes.insert(bytes.end(), value, value + std::strlen(value) + 1);
+	}
+
+	void write_file(const std::vector<char>& bytes, const std::filesystem::path& filepath)
+	{
+		std::ofstream file(filepath, std::ios::binary);
+		file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+		if (!file)
+			THROW_ERROR("Can't save the resource");
+	}
+
+	// PFM stores the rows bottom to top, a negative scale marks little-endian data
+	void save_pfm(const float* rgb, size_t width, size_t height, const std::filesystem::path& filepath)
+	{
+		const std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+		const size_t row_size = width * 3 * sizeof(float);
+
+		std::vector<char> bytes(header.begin(), header.end());
+		bytes.reserve(header.size() + row_size * height);
+		for (size_t y = height; y-- > 0;) {
+			const char* row = reinterpret_cast<const char*>(rgb + y * width * 3);
+			bytes.insert(bytes.end(), row, row + row_size);
+		}
+		write_file(bytes, filepath);
+	}
+
+	// Scanline OpenEXR with 32-bit float B, G and R channels and no
+	// compression, so writing is a copy. One scanline per chunk, every chunk
+	// holds its channels one after another in name order
+	void save_exr(const float* rgb, size_t width, size_t height, const std::filesystem::path& filepath)
+	{
+		constexpr int32_t float_pixels = 2;
+		constexpr uint8_t no_compression = 0;
+		constexpr uint8_t increasing_y = 0;
+		const int32_t max_x = static_cast<int32_t>(width) - 1;
+		const int32_t max_y = static_cast<int32_t>(height) - 1;
+
+		std::vector<char> bytes;
+		append(bytes, uint32_t{20000630});
+		append(bytes, uint32_t{2});
+
+		append_string(bytes, "channels");
+		append_string(bytes, "chlist");
+		append(bytes, int32_t{3 * 18 + 1});
+		for (const char* channel: {"B", "G", "R"}) {
+			append_string(bytes, channel);
+			append(bytes, float_pixels);
+			// Perceptually linear flag and three reserved bytes
+			append(bytes, uint32_t{0});
+			append(bytes, int32_t{1});
+			append(bytes, int32_t{1});
+		}
+		bytes.push_back('\0');
+
+		append_string(bytes, "compression");
+		append_string(bytes, "compression");
+		append(bytes, int32_t{1});
+		append(bytes, no_compression);
+
+		for (const char* window: {"dataWindow", "displayWindow"}) {
+			append_string(bytes, window);
+			append_string(bytes, "box2i");
+			append(bytes, int32_t{16});
+			append(bytes, int32_t{0});
+			append(bytes, int32_t{0});
+			append(bytes, max_x);
+			append(bytes, max_y);
+		}
+
+		append_string(bytes, "lineOrder");
+		append_string(bytes, "lineOrder");
+		append(bytes, int32_t{1});
+		append(bytes, increasing_y);
+
+		append_string(bytes, "pixelAspectRatio");
+		append_string(bytes, "float");
+		append(bytes, int32_t{4});
+		append(bytes, 1.f);
+
+		append_string(bytes, "screenWindowCenter");
+		append_string(bytes, "v2f");
+		append(bytes, int32_t{8});
+		append(bytes, 0.f);
+		append(bytes, 0.f);
+
+		append_string(bytes, "screenWindowWidth");
+		append_string(bytes, "float");
+		append(bytes, int32_t{4});
+		append(bytes, 1.f);
+		bytes.push_back('\0');
+
+		const size_t channel_size = width * sizeof(float);
+		const size_t chunk_size = 2 * sizeof(int32_t) + 3 * channel_size;
+		const size_t table_end = bytes.size() + height * sizeof(uint64_t);
+		for (size_t y = 0; y < height; y++)
+			append(bytes, static_cast<uint64_t>(table_end + y * chunk_size));
+
+		bytes.resize(table_end + height * chunk_size);
+		for (size_t y = 0; y < height; y++) {
+			char* chunk = bytes.data() + table_end + y * chunk_size;
+			const int32_t line = static_cast<int32_t>(y);
+			const int32_t data_size = static_cast<int32_t>(3 * channel_size);
+			std::memcpy(chunk, &line, sizeof(line));
+			std::memcpy(chunk + sizeof(line), &data_size, sizeof(data_size));
+
+			float* channels = reinterpret_cast<float*>(chunk + 2 * sizeof(int32_t));
+			const float* row = rgb + y * width * 3;
+			for (size_t x = 0; x < width; x++) {
+				channels[x] = row[x * 3 + 2];
+				channels[width + x] = row[x * 3 + 1];
+				channels[2 * width + x] = row[x * 3];
+			}
+		}
+		write_file(bytes, filepath);
+	}
+
+	void save_float_image(const float* rgb, size_t width, size_t height, const std::filesystem::path& filepath)
+	{
+		const auto extension = filepath.extension();
+		if (extension == ".pfm")
+			save_pfm(rgb, width, height, filepath);
+		else if (extension == ".exr")
+			save_exr(rgb, width, height, filepath);
+		else
+			THROW_ERROR("Float images are saved as .pfm or .exr, not " + filepath.string());
+	}
+}// namespace
+
+void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, const std::filesystem::path filepath,
+							  bool show)
 {
 	int width = static_cast<int>(render_target.get_stride());
 	int height = static_cast<int>(render_target.get_number_of_elements()) / width;
@@ -31,7 +176,24 @@ void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, c
 	if (result != 1)
 		THROW_ERROR("Can't save the resource");
 
+	if (!show)
+		return;
+
 	auto command = view_command(filepath);
 	if (!command.empty())
 		std::system(command.c_str());
 }
+
+void cg::utils::save_resource(cg::resource<cg::float_color>& render_target, const std::filesystem::path filepath)
+{
+	size_t width = render_target.get_stride();
+	size_t height = render_target.get_number_of_elements() / width;
+	save_float_image(&render_target.get_data()->r, width, height, filepath);
+}
+
+void cg::utils::save_resource(cg::resource<float3>& resource, const std::filesystem::path filepath)
+{
+	size_t width = resource.get_stride();
+	size_t height = resource.get_number_of_elements() / width;
+	save_float_image(&resource.get_data()->x, width, height, filepath);
+}
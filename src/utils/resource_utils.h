@@ -7,5 +7,11 @@
 
 namespace cg::utils
 {
-	void save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath);
+	// Opens the image in the system viewer afterwards unless show is false
+	void save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath,
+					   bool show = true);
+	// Float images are written uncompressed, as PFM or OpenEXR depending on
+	// the extension of the path
+	void save_resource(cg::resource<cg::float_color>& render_target, std::filesystem::path filepath);
+	void save_resource(cg::resource<float3>& resource, std::filesystem::path filepath);
 }
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+
+
+namespace
+{
+	// Interleaves the lower 16 bits of x and y
+	uint32_t morton_code(uint32_t x, uint32_t y)
+	{
+		auto spread = [](uint32_t value) {
+			value &= 0x0000ffff;
+			value = (value | (value << 8)) & 0x00ff00ff;
+			value = (value | (value << 4)) & 0x0f0f0f0f;
+			value = (value | (value << 2)) & 0x33333333;
+			value = (value | (value << 1)) & 0x55555555;
+			return value;
+		};
+		return spread(x) | (spread(y) << 1);
+	}
+}// namespace
+
+cg::utils::tile_scheduler::tile_scheduler(size_t width, size_t height, size_t tile_size,
+										  unsigned worker_count)
+	: queues(std::max(worker_count, 1u))
+{
+	const size_t tiles_x = (width + tile_size - 1) / tile_size;
+	const size_t tiles_y = (height + tile_size - 1) / tile_size;
+
+	std::vector<size_t> order(tiles_x * tiles_y);
+	std::iota(order.begin(), order.end(), size_t{0});
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return morton_code(static_cast<uint32_t>(a % tiles_x), static_cast<uint32_t>(a / tiles_x)) <
+			   morton_code(static_cast<uint32_t>(b % tiles_x), static_cast<uint32_t>(b / tiles_x));
+	});
+
+	tiles.reserve(order.size());
+	for (size_t index: order) {
+		const size_t x = (index % tiles_x) * tile_size;
+		const size_t y = (index / tiles_x) * tile_size;
+		tiles.push_back({x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)});
+	}
+
+	reset();
+}
+
+void cg::utils::tile_scheduler::reset()
+{
+	const size_t worker_count = queues.size();
+	for (size_t worker_id = 0; worker_id < worker_count; worker_id++) {
+		std::lock_guard<std::mutex> lock(queues[worker_id].mutex);
+		queues[worker_id].begin = tiles.size() * worker_id / worker_count;
+		queues[worker_id].end = tiles.size() * (worker_id + 1) / worker_count;
+	}
+}
+
+bool cg::utils::tile_scheduler::next_tile(unsigned worker_id, size_t& tile_id)
+{
+	worker_queue& own = queues[worker_id % queues.size()];
+	do {
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (own.begin < own.end) {
+			tile_id = own.begin++;
+			return true;
+		}
+	} while (steal(worker_id));
+	return false;
+}
+
+size_t cg::utils::tile_scheduler::get_tile_count() const
+{
+	return tiles.size();
+}
+
+const cg::utils::tile_scheduler::tile& cg::utils::tile_scheduler::get_tile(size_t tile_id) const
+{
+	return tiles[tile_id];
+}
+
+// Takes the back half of the first non-empty run after the worker's own,
+// which keeps both halves contiguous in Morton order
+bool cg::utils::tile_scheduler::steal(unsigned worker_id)
+{
+	const size_t worker_count = queues.size();
+	const size_t own_id = worker_id % worker_count;
+	for (size_t offset = 1; offset < worker_count; offset++) {
+		worker_queue& victim = queues[(own_id + offset) % worker_count];
+		size_t begin, end;
+		{
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.begin >= victim.end)
+				continue;
+			begin = victim.begin + (victim.end - victim.begin) / 2;
+			end = victim.end;
+			victim.end = begin;
+		}
+
+		std::lock_guard<std::mutex> lock(queues[own_id].mutex);
+		queues[own_id].begin = begin;
+		queues[own_id].end = end;
+		return true;
+	}
+	return false;
+}
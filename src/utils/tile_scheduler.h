@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+
+namespace cg::utils
+{
+	// Square image tiles handed out in Morton order. Every worker starts on
+	// its own contiguous run of tiles and, once that is done, steals the back
+	// half of another worker's remaining run.
+	class tile_scheduler
+	{
+	public:
+		struct tile
+		{
+			size_t x_begin;
+			size_t y_begin;
+			size_t x_end;
+			size_t y_end;
+		};
+
+		tile_scheduler(size_t width, size_t height, size_t tile_size, unsigned worker_count);
+
+		// Hands every tile out again
+		void reset();
+		// Claims the next tile for the worker, false once all of them are taken
+		bool next_tile(unsigned worker_id, size_t& tile_id);
+
+		size_t get_tile_count() const;
+		const tile& get_tile(size_t tile_id) const;
+
+	private:
+		struct alignas(64) worker_queue
+		{
+			std::mutex mutex;
+			size_t begin = 0;
+			size_t end = 0;
+		};
+
+		bool steal(unsigned worker_id);
+
+		std::vector<tile> tiles;
+		std::vector<worker_queue> queues;
+	};
+}// namespace cg::utils
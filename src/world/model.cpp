@@ -168,6 +168,7 @@ void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tiny
 					cg::vertex& vertex = vertex_buffer->item(vertex_buffer_id);
 					const auto& material = materials[mesh.material_ids[f]];
 					fill_vertex_data(vertex,attrib,idx,normal,material);
+					vertex.material_id = mesh.material_ids[f];
 					index_map[idx_tuple] = vertex_buffer_id;
 					vertex_buffer_id++;
 				}